@@ -1,290 +1,2869 @@
 /** @file alloc.c */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+
+#include "alloc.h"
+
+
+//CONSTANTS
+#define ALIGNMENT 16						//every block size is a multiple of this
+#define SMALL_BIN_MAX 1024					//largest size kept in an exact-fit bin
+#define SMALL_BINS (SMALL_BIN_MAX/ALIGNMENT)	//one bin per 16 bytes up to 1024
+#define LARGE_SUBBINS 4						//log-spaced bins per power of two
+#define LARGE_BINS (LARGE_SUBBINS*(64-10))	//powers of two from 2^10 up
+#define NUM_BINS (SMALL_BINS+LARGE_BINS)
+#define BINMAP_WORDS ((NUM_BINS+63)/64)
+#define MMAP_CLASS NUM_BINS					//stats class for mmapped blocks
+
+//alloc.h spells out the number of classes, make sure it agrees
+typedef char classesMatch[ALLOC_SIZE_CLASSES==NUM_BINS+1 ? 1 : -1];
+
+
+#define HEADER_SIZE (2*sizeof(size_t))		//prevSize and size sit in front of the data
+#define MIN_BLOCK (HEADER_SIZE+2*sizeof(void*))	//room for the free list links
+#define DEFAULT_MMAP_THRESHOLD (128*1024)	//requests this big start out mmapped
+#define MAX_MMAP_THRESHOLD (32*1024*1024)	//the sliding threshold never goes past this
+#define TOP_PAD (64*1024)					//the break never moves up by less than this
+#define CALLOC_MMAP_THRESHOLD (128*1024)	//zeroed requests this big always get fresh pages
+
+#define MAX_ARENAS 64						//hard cap on arenas, the main one included
+#define HEAP_SIZE (64*1024*1024)			//size and alignment of a secondary arena's heaps
+#define HEAP_OFFSET ALIGNMENT				//room for the HeapInfo at the start of a heap
+#define HEAP_MAX_BLOCK (HEAP_SIZE-HEAP_OFFSET-HEADER_SIZE)	//biggest block a heap can hold
+#define HUGE_PAGE (2*1024*1024)				//transparent huge page size, HEAP_SIZE is a multiple
+
+#define TCACHE_MAX 32						//cached blocks per size class and thread
+#define TCACHE_FILL 16						//blocks moved per refill from the arena
+#define TRACE_BUFFER 128					//trace records a thread buffers before writing them
+#define PROFILE_RATE (4*1024*1024)			//default mean bytes between samples, each one costs a backtrace() of about 3 us
+#define PROFILE_DEPTH 32					//stack frames kept per sample
+#define PROFILE_BUCKETS (1<<16)				//hash buckets for live samples
+
+#define SLAB_MAX_CACHES 32					//slab caches that get per-thread magazines
+#define SLAB_MAGAZINE 32					//objects per magazine
+#define SLAB_CHUNK (64*1024)				//bytes mapped per slab chunk, at least
+#define REGION_CHUNK (64*1024)				//bytes mapped per region chunk, at least
+
+//flags kept in the low bits of MemoryBlock.size, which is always 16-aligned
+#define INUSE 0x1		//this block is handed out (or sitting in a thread cache)
+#define PREV_INUSE 0x2	//the block right before this one is handed out
+#define MMAPPED 0x4		//block has its own mapping, prevSize is the offset into it
+#define NON_MAIN 0x8	//block lives in a secondary arena's heap
+//and one in the top bit, which no block size gets near
+#define SAMPLED ((size_t)1<<(8*sizeof(size_t)-1))	//the in-use block has a live profile sample
+#define FLAGS (INUSE|PREV_INUSE|MMAPPED|NON_MAIN|SAMPLED)
+
+//flag kept in the low bits of a free block's footer (the next block's prevSize)
+#define ZEROED 0x1		//the free block is all zero past its list links
 
 
 //GLOBAL VARIABLES
+/*
+ * Header in front of every block. The user pointer starts at next, so a live
+ * block only pays for prevSize and size. prevSize is the boundary tag (footer)
+ * of the block before this one and is only meaningful while that block is free.
+ */
 typedef struct _MemoryBlock
 {
-	void *address;
-	size_t size;
-	int free; //bools aren't real, 0=false, 1=true
-	struct _MemoryBlock *left;
-	struct _MemoryBlock *right;
-}MemoryBlock
+	size_t prevSize;
+	size_t size;					//whole block including header, plus flags
+	struct _MemoryBlock *next;		//neighbours in the size-class bin, free only
+	struct _MemoryBlock *prev;
+}MemoryBlock;
+
+/*
+ * An independently locked set of bins. The main arena (arenas[0]) grows the
+ * sbrk heap; the others carve their blocks out of HEAP_SIZE-aligned mappings,
+ * and a block finds its way home through the HeapInfo at the start of its heap.
+ */
+typedef struct _Arena
+{
+	pthread_mutex_t lock;
+	MemoryBlock *bins[NUM_BINS];				//free lists, one per size class
+	unsigned long long binMap[BINMAP_WORDS];	//bit set when the bin is non-empty
+	MemoryBlock *epilogue;						//main arena only, zero-sized block at the break
+	size_t freeBytes;							//total size of the binned blocks
+	int heaps;									//heaps mapped by heapNew() and not yet released
+}Arena;
+
+typedef struct _HeapInfo
+{
+	Arena *arena;
+	size_t pad;		//keeps the first block 16-aligned
+}HeapInfo;
+
+/*
+ * Per-thread stacks of small blocks, one per exact-fit size class. Blocks in
+ * here still look in-use to their arena; they are refilled from and flushed
+ * back to it in batches so most malloc/free calls never take a lock.
+ */
+typedef struct _ThreadCache
+{
+	MemoryBlock *lists[SMALL_BINS];
+	int counts[SMALL_BINS];
+	Arena *arena;
+	int initialized;
+	unsigned long allocs[ALLOC_SIZE_CLASSES];	//allocations made by this thread, per class
+	struct _ThreadCache *nextCache;				//every live thread's cache, for the stats
+	struct _ThreadCache *prevCache;
+	alloc_trace_t trace[TRACE_BUFFER];			//records not written to the trace yet
+	int traceCount;
+	int hookDepth;								//>0 inside a call that is traced or sampled already
+	uint32_t traceThread;						//this thread's number in the trace
+	long sampleLeft;							//bytes to allocate until the next sample
+	uint64_t sampleRand;						//xorshift state, 0 until the first sample
+}ThreadCache;
+
+Arena arenas[MAX_ARENAS]={{.lock=PTHREAD_MUTEX_INITIALIZER}};	//the rest starts out zero
+int arenaCount=1;					//arenas set up so far
+int arenaLimit=1;					//how many arenas threads are spread over
+unsigned int arenaNext=0;			//round-robin counter for new threads
+pthread_mutex_t initLock=PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t cacheKey;				//only used to flush a cache when its thread exits
+__thread ThreadCache tcache;
+ThreadCache *caches=NULL;			//registered caches, guarded by initLock
+
+/*
+ * Allocator-wide counters. They only move around system calls, so relaxed
+ * atomics cost nothing next to the call itself; allocation counts are kept
+ * per thread and summed when the stats are read.
+ */
+size_t statHeap=0;					//bytes in the sbrk heap and secondary heaps
+size_t statMapped=0;				//bytes in mmapped blocks, slab chunks and regions
+size_t statPeak=0;					//highest statHeap+statMapped seen
+unsigned long statSbrk=0, statMmap=0, statMunmap=0, statMremap=0;
+unsigned long retiredAllocs[ALLOC_SIZE_CLASSES];	//counts of threads that have exited
+
+/*
+ * Tracing, on when ALLOC_TRACE names a file prefix. Each thread fills the
+ * buffer in its cache and writes it out in one go under traceLock.
+ */
+int traceFd=-1;
+char *tracePrefix=NULL;
+uint64_t traceSeq=0;				//next sequence number
+uint32_t traceThreads=0;			//thread numbers handed out so far
+pthread_mutex_t traceLock=PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Heap profiling, on when ALLOC_PROFILE names a file prefix. Roughly one
+ * allocation per profileRate bytes is sampled with its stack; live samples are
+ * hashed by address so free() can drop them, and the table is dumped in the
+ * heap format pprof reads on a signal and at exit. A sampled block is tagged
+ * SAMPLED in its header, so free() only looks up the blocks that have a sample.
+ */
+typedef struct _Sample
+{
+	struct _Sample *next;		//hash chain
+	uintptr_t addr;
+	size_t size;				//bytes asked for
+	int depth;
+	void *stack[PROFILE_DEPTH];
+}Sample;
+
+long profileRate=0;					//mean bytes between samples, 0 when off
+char *profilePrefix=NULL;
+Sample *samples[PROFILE_BUCKETS];	//live samples by address
+slab_t sampleSlab;
+int profilePipe[2]={-1, -1};		//the signal handler writes a byte per dump to the dump thread
+unsigned int profileDumps=0;		//dumps written, numbers the files
+pthread_mutex_t profileLock=PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A thread's stack of free objects for one slab cache. cache and gen say which
+ * cache the objects came from, so a magazine left over from a destroyed cache
+ * is simply dropped.
+ */
+typedef struct _SlabMagazine
+{
+	slab_t *cache;
+	unsigned int gen;
+	int count;
+	void *objs[SLAB_MAGAZINE];
+}SlabMagazine;
+
+//header of a region chunk, the bump-allocated space follows it
+typedef struct _RegionChunk
+{
+	struct _RegionChunk *next;
+	size_t size;			//whole mapping, header included
+}RegionChunk;
+
+slab_t *slabCaches[SLAB_MAX_CACHES];	//live caches by id, guarded by initLock
+slab_t *slabList=NULL;				//every live cache, id or not, guarded by initLock
+unsigned int slabGen=0;
+__thread SlabMagazine magazines[SLAB_MAX_CACHES];
+
+
+//Prototypes
+static void slabFlushThread();
+static void traceFlush(ThreadCache *cache);
+static void profileSample(void *addr, size_t size);
+static void profileDrop(void *ptr);
+static MemoryBlock *mmapAligned(size_t alignment, size_t size);
+void malloc_stats();
+
+/*
+ * Requests at or above mmapThreshold get their own mapping. Like glibc, the
+ * threshold slides up to the size of any mmapped block that gets freed (so a
+ * program that keeps reallocating buffers of one size moves them onto the
+ * heap) and the trim threshold follows at twice that. Setting
+ * ALLOC_MMAP_THRESHOLD or ALLOC_TRIM_THRESHOLD in the environment pins them.
+ */
+size_t mmapThreshold=DEFAULT_MMAP_THRESHOLD;
+size_t trimThreshold=2*DEFAULT_MMAP_THRESHOLD;
+int thresholdsPinned=0;
+int initialized=0;
+int dumpStats=0;					//ALLOC_STATS is set, print the stats at exit
+int hugePages=0;					//ALLOC_HUGEPAGES is set and the kernel has THP
+size_t pageSize=4096;
+
+
+//size/flag accessors for the in-band header
+#define blockSize(b) ((b)->size&~(size_t)FLAGS)
+#define nextBlock(b) ((MemoryBlock*)((char*)(b)+blockSize(b)))
+#define prevBlock(b) ((MemoryBlock*)((char*)(b)-((b)->prevSize&~(size_t)FLAGS)))
+#define isZeroed(b) (nextBlock(b)->prevSize&ZEROED)
+#define blockToMem(b) ((void*)((char*)(b)+HEADER_SIZE))
+#define memToBlock(p) ((MemoryBlock*)((char*)(p)-HEADER_SIZE))
+#define blockArena(b) ((b)->size&NON_MAIN ? \
+		((HeapInfo*)((uintptr_t)(b)&~(uintptr_t)(HEAP_SIZE-1)))->arena : &arenas[0])
+
+
+/*
+ * Maps a (rounded) block size to its bin. Sizes up to SMALL_BIN_MAX get an
+ * exact-fit bin, anything larger goes into one of four bins per power of two.
+ */
+static int binIndex(size_t size)
+{
+	int bin;
+
+	if(size<=SMALL_BIN_MAX)
+	{
+		bin=(int)(size/ALIGNMENT)-1;
+	}
+	else
+	{
+		int msb=63-__builtin_clzll((unsigned long long)size);
+		int sub=(int)((size>>(msb-2))&(LARGE_SUBBINS-1));
+		bin=SMALL_BINS+(msb-10)*LARGE_SUBBINS+sub;
+	}
+
+
+	return bin;
+}
+
+//smallest block size that lands in a bin, the inverse of binIndex()
+static size_t binSize(int bin)
+{
+	size_t size;
+
+	if(bin<SMALL_BINS)
+	{
+		size=(size_t)(bin+1)*ALIGNMENT;
+	}
+	else
+	{
+		int msb=(bin-SMALL_BINS)/LARGE_SUBBINS+10;
+		int sub=(bin-SMALL_BINS)%LARGE_SUBBINS;
+		size=((size_t)1<<msb)+((size_t)sub<<(msb-2));
+		if(size<=SMALL_BIN_MAX)
+			size=SMALL_BIN_MAX+ALIGNMENT;
+	}
+
+
+	return size;
+}
+
+//pushes a free block onto the front of its bin
+static void binInsert(Arena *arena, MemoryBlock *block)
+{
+	int bin=binIndex(blockSize(block));
+
+	block->prev=NULL;
+	block->next=arena->bins[bin];
+	if(arena->bins[bin]!=NULL)
+		arena->bins[bin]->prev=block;
+	arena->bins[bin]=block;
+	arena->binMap[bin/64]|=1ULL<<(bin%64);
+	arena->freeBytes+=blockSize(block);
+
+
+	return;
+}
+
+//unlinks a free block from its bin
+static void binRemove(Arena *arena, MemoryBlock *block)
+{
+	int bin=binIndex(blockSize(block));
+
+	if(block->prev!=NULL)
+		block->prev->next=block->next;
+	else
+		arena->bins[bin]=block->next;
+	if(block->next!=NULL)
+		block->next->prev=block->prev;
+	if(arena->bins[bin]==NULL)
+		arena->binMap[bin/64]&=~(1ULL<<(bin%64));
+	arena->freeBytes-=blockSize(block);
+
+
+	return;
+}
+
+/*
+ * Finds a free block of at least size bytes. Small bins are exact fits so the
+ * head is taken, the starting large bin is searched first-fit, and after that
+ * any block in a higher non-empty bin is big enough, found through binMap.
+ */
+static MemoryBlock *binFind(Arena *arena, size_t size)
+{
+	int bin=binIndex(size);
+	MemoryBlock *found=NULL;
+	MemoryBlock *itr;
+
+
+	for(itr=arena->bins[bin]; itr!=NULL && found==NULL; itr=itr->next)
+	{
+		if(blockSize(itr)>=size)
+			found=itr;
+	}
+
+	bin++;
+	while(found==NULL && bin<NUM_BINS)
+	{
+		unsigned long long word=arena->binMap[bin/64]&(~0ULL<<(bin%64));
+		if(word!=0)
+			found=arena->bins[(bin/64)*64+__builtin_ctzll(word)];
+		else
+			bin=(bin/64+1)*64;
+	}
+
+	if(found!=NULL)
+		binRemove(arena, found);
+
+
+	return found;
+}
+
+/*
+ * Adds delta to one of the footprint counters and raises statPeak if the
+ * total went past it.
+ */
+static void statFootprint(size_t *counter, size_t delta)
+{
+	size_t now;
+	size_t peak=__atomic_load_n(&statPeak, __ATOMIC_RELAXED);
+
+
+	__atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+	now=__atomic_load_n(&statHeap, __ATOMIC_RELAXED)+__atomic_load_n(&statMapped, __ATOMIC_RELAXED);
+	while(now>peak && !__atomic_compare_exchange_n(&statPeak, &peak, now, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+
+	return;
+}
+
+//sbrk with accounting, for calls that really move the break
+static void *osSbrk(intptr_t delta)
+{
+	void *old=sbrk(delta);
+
+
+	__atomic_add_fetch(&statSbrk, 1, __ATOMIC_RELAXED);
+	if(old!=(void*)-1)
+		statFootprint(&statHeap, (size_t)delta);
+
+
+	return old;
+}
+
+/*
+ * Anonymous read/write mmap with accounting against counter. A NULL counter
+ * leaves the bytes to the caller, which counts what it keeps of an oversized
+ * mapping once the rest is trimmed, so the peak never sees the excess.
+ */
+static void *osMap(size_t length, int flags, size_t *counter)
+{
+	void *map=mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|flags, -1, 0);
+
+
+	__atomic_add_fetch(&statMmap, 1, __ATOMIC_RELAXED);
+	if(map!=MAP_FAILED && counter!=NULL)
+		statFootprint(counter, length);
+
+
+	return map;
+}
+
+//munmap with accounting against counter, which may be NULL like for osMap()
+static void osUnmap(void *addr, size_t length, size_t *counter)
+{
+	__atomic_add_fetch(&statMunmap, 1, __ATOMIC_RELAXED);
+	if(munmap(addr, length)==0 && counter!=NULL)
+		__atomic_sub_fetch(counter, length, __ATOMIC_RELAXED);
+
+
+	return;
+}
+
+/*
+ * Marks a block handed out and tells the block after it. That one may be live
+ * in another thread, which sets SAMPLED without the arena lock, so its size
+ * is only ever changed atomically.
+ */
+static void setInUse(MemoryBlock *block)
+{
+	block->size|=INUSE;
+	__atomic_or_fetch(&nextBlock(block)->size, PREV_INUSE, __ATOMIC_RELAXED);
+
+
+	return;
+}
+
+/*
+ * Marks a block free and writes its footer into the next block's prevSize,
+ * tagged ZEROED if everything past the block's list links is known to be 0.
+ * The next block's size changes atomically, as in setInUse().
+ */
+static void setFree(MemoryBlock *block, int zero)
+{
+	MemoryBlock *next=nextBlock(block);
+
+	block->size&=~(size_t)INUSE;
+	__atomic_and_fetch(&next->size, ~(size_t)PREV_INUSE, __ATOMIC_RELAXED);
+	next->prevSize=blockSize(block)|(zero ? ZEROED : 0);
+
+
+	return;
+}
+
+/*
+ * Merges a block that is about to become free with whichever neighbours are
+ * already free. The neighbours are pulled out of their bins; the merged block
+ * is returned without being binned or marked free. *zero says whether the
+ * block is zeroed on the way in and whether the merged block is on the way
+ * out; merging zeroed blocks only costs clearing the headers that end up
+ * inside the merged block.
+ */
+static MemoryBlock *coalesce(Arena *arena, MemoryBlock *block, int *zero)
+{
+	MemoryBlock *next=nextBlock(block);
+	MemoryBlock *first=block;
+	size_t size=blockSize(block);
+	int merged=*zero;
+
+
+	if(!(next->size&INUSE))
+	{
+		merged=merged && isZeroed(next);
+		binRemove(arena, next);
+		size+=blockSize(next);
+	}
+	else
+	{
+		next=NULL;
+	}
+	if(!(block->size&PREV_INUSE))
+	{
+		MemoryBlock *prev=prevBlock(block);
+		merged=merged && (block->prevSize&ZEROED);
+		binRemove(arena, prev);
+		size+=blockSize(prev);
+		block=prev;
+	}
+	block->size=size|(block->size&FLAGS);
+
+	if(merged && next!=NULL)
+		memset(next, 0, MIN_BLOCK);
+	if(merged && first!=block)
+		memset(first, 0, MIN_BLOCK);
+	*zero=merged;
+
+
+	return block;
+}
+
+/*
+ * Cuts an allocated block down to size bytes and bins the tail, if the tail is
+ * big enough to be a block of its own. The tail is merged forward in case the
+ * block after it is free (it can be when shrinking a live block). zero says
+ * whether the block being cut up was zeroed, which the tail inherits.
+ */
+static void split(Arena *arena, MemoryBlock *block, size_t size, int zero)
+{
+	size_t excess=blockSize(block)-size;
+
+
+	if(excess>=MIN_BLOCK)
+	{
+		MemoryBlock *tail;
+
+		block->size=size|(block->size&FLAGS);
+		tail=nextBlock(block);
+		tail->size=excess|PREV_INUSE|(block->size&NON_MAIN);
+		tail=coalesce(arena, tail, &zero);
+		setFree(tail, zero);
+		binInsert(arena, tail);
+	}
+
+
+	return;
+}
+
+/*
+ * Grows the main heap so a block of at least size bytes is available (the
+ * caller splits off what it does not need). The new space takes over the old
+ * epilogue's spot, so its prevSize still holds the footer of the last block,
+ * and if that block is free only the difference is asked of sbrk and the two
+ * are merged. A fresh epilogue is written behind it. If something else moved
+ * the break in between, a separate run of blocks starts. Memory new to the
+ * break is zero, so *zero reports whether the whole block is.
+ */
+static MemoryBlock *heapExtend(Arena *arena, size_t size, int *zero)
+{
+	MemoryBlock *block=NULL;
+	MemoryBlock *epilogue=arena->epilogue;
+	char *brk=sbrk(0);
+	size_t pad=0;
+	size_t have=0;
+	size_t grow;
+
+
+	if(epilogue==NULL || brk!=(char*)epilogue+HEADER_SIZE)
+		pad=(ALIGNMENT-((size_t)brk%ALIGNMENT))%ALIGNMENT+HEADER_SIZE;
+	else if(!(epilogue->size&PREV_INUSE))
+		have=epilogue->prevSize&~(size_t)FLAGS;
+
+	grow=size-have;
+	if(grow<TOP_PAD)
+		grow=TOP_PAD;
+
+	if(brk!=(void*)-1 && osSbrk(pad+grow)==brk)
+	{
+		if(pad!=0)
+		{
+			block=(MemoryBlock*)(brk+pad-HEADER_SIZE);
+			block->size=grow|PREV_INUSE;
+		}
+		else
+		{
+			block=epilogue;
+			block->size=grow|(epilogue->size&PREV_INUSE);
+		}
+
+		arena->epilogue=nextBlock(block);
+		arena->epilogue->size=0|INUSE;
+		*zero=pad==0 || epilogue==NULL;	//unless someone else moved the break
+		block=coalesce(arena, block, zero);
+	}
+
+
+	return block;
+}
+
+/*
+ * Asks for transparent huge pages on a 2 MB-aligned range. A kernel without
+ * THP fails the call, and huge page mode is then dropped for good.
+ */
+static void hugeAdvise(void *addr, size_t length)
+{
+#ifdef MADV_HUGEPAGE
+	if(madvise(addr, length, MADV_HUGEPAGE)!=0)
+		hugePages=0;
+#else
+	(void)addr;
+	(void)length;
+	hugePages=0;
+#endif
+
+
+	return;
+}
+
+/*
+ * Maps a fresh HEAP_SIZE-aligned heap for a secondary arena (or for the main
+ * one in huge page mode) and returns its single big block, still unbinned.
+ * Twice the size is mapped so an aligned window can be cut out of it.
+ */
+static MemoryBlock *heapNew(Arena *arena)
+{
+	MemoryBlock *block=NULL;
+	char *map=osMap(2*(size_t)HEAP_SIZE, MAP_NORESERVE, NULL);
+
+
+	if(map!=MAP_FAILED)
+	{
+		char *heap=(char*)(((uintptr_t)map+HEAP_SIZE-1)&~(uintptr_t)(HEAP_SIZE-1));
+		MemoryBlock *epilogue;
+
+		if(heap!=map)
+			osUnmap(map, heap-map, NULL);
+		osUnmap(heap+HEAP_SIZE, map+HEAP_SIZE-heap, NULL);
+		statFootprint(&statHeap, HEAP_SIZE);
+		if(hugePages)
+			hugeAdvise(heap, HEAP_SIZE);
+
+		((HeapInfo*)heap)->arena=arena;
+		arena->heaps++;
+		block=(MemoryBlock*)(heap+HEAP_OFFSET);
+		block->size=HEAP_MAX_BLOCK|PREV_INUSE|NON_MAIN;
+		epilogue=nextBlock(block);
+		epilogue->size=0|INUSE|NON_MAIN;
+	}
+
+
+	return block;
+}
+
+/*
+ * Gives the memory of a free block that ends at the epilogue back to the OS,
+ * once there is enough of it to be worth a system call. The block must not be
+ * in a bin. Secondary heaps cannot shrink, so there the pages inside a large
+ * block are handed back with madvise and the block stays where it is; in huge
+ * page mode only whole huge pages, so the ones around them are not split. A
+ * heap that is entirely free is unmapped, unless it is the arena's last one.
+ */
+static int heapTrim(Arena *arena, MemoryBlock *block)
+{
+	int trimmed=0;
+	size_t size=blockSize(block);
+	MemoryBlock *epilogue=arena->epilogue;
+
+
+	if(block->size&NON_MAIN)
+	{
+		if(size==HEAP_MAX_BLOCK && arena->heaps>1)
+		{
+			osUnmap((char*)block-HEAP_OFFSET, HEAP_SIZE, &statHeap);
+			arena->heaps--;
+			trimmed=1;
+		}
+		else if(size>=trimThreshold)
+		{
+			size_t unit=hugePages ? HUGE_PAGE : pageSize;
+			char *start=(char*)(((uintptr_t)block+MIN_BLOCK+unit-1)&~(uintptr_t)(unit-1));
+			char *end=(char*)(((uintptr_t)nextBlock(block))&~(uintptr_t)(unit-1));
+			if(end>start)
+				madvise(start, end-start, MADV_DONTNEED);
+		}
+	}
+	else if(nextBlock(block)==epilogue && size>=trimThreshold
+			&& sbrk(0)==(char*)epilogue+HEADER_SIZE)
+	{
+		//the rest of the page the break ends up in stays mapped, clear it so
+		//memory past the break is zero again when the heap grows back
+		char *brk=(char*)block+HEADER_SIZE;
+		char *pageEnd=(char*)(((uintptr_t)brk+pageSize-1)&~(uintptr_t)(pageSize-1));
+		memset(brk, 0, pageEnd-brk);
+
+		if(osSbrk(-(intptr_t)size)!=(void*)-1)
+		{
+			arena->epilogue=block;
+			block->size=0|INUSE|(block->size&PREV_INUSE);
+			trimmed=1;
+		}
+	}
+
+
+	return trimmed;
+}
+
+/*
+ * Tries to grow a live heap block to size bytes without moving it, first by
+ * absorbing a free block after it and, if the block (or that free block) ends
+ * at the main arena's epilogue, by moving the break. Any excess is split off
+ * again.
+ */
+static int growInPlace(Arena *arena, MemoryBlock *block, size_t size)
+{
+	int grown=0;
+	MemoryBlock *next=nextBlock(block);
+	MemoryBlock *epilogue=arena->epilogue;
+	size_t have=blockSize(block);
+
+
+	if(!(next->size&INUSE))
+		have+=blockSize(next);
+
+	if(have<size && epilogue!=NULL && sbrk(0)==(char*)epilogue+HEADER_SIZE
+			&& (next==epilogue || (!(next->size&INUSE) && nextBlock(next)==epilogue)))
+	{
+		size_t grow=size-have;
+		if(grow<TOP_PAD)
+			grow=TOP_PAD;
+
+		if(osSbrk(grow)!=(void*)-1)
+		{
+			if(next!=epilogue)
+				binRemove(arena, next);
+			block->size=(have+grow)|(block->size&FLAGS);
+			arena->epilogue=nextBlock(block);
+			arena->epilogue->size=0|INUSE;
+			grown=1;
+		}
+	}
+	else if(have>=size)
+	{
+		if(!(next->size&INUSE))
+			binRemove(arena, next);
+		block->size=have|(block->size&FLAGS);
+		grown=1;
+	}
+
+	if(grown)
+	{
+		split(arena, block, size, 0);
+		setInUse(block);
+	}
+
+
+	return grown;
+}
+
+/*
+ * Hands out a block of at least size bytes from an arena whose lock is held,
+ * growing the arena if no bin has one. If zero is not NULL it is set to
+ * whether the block is known to be all zero past its first 16 data bytes.
+ */
+static MemoryBlock *arenaAlloc(Arena *arena, size_t size, int *zero)
+{
+	MemoryBlock *block=binFind(arena, size);
+	int clean=0;
+
+
+	if(block!=NULL)
+	{
+		clean=isZeroed(block)!=0;
+	}
+	else if(arena==&arenas[0] && !hugePages)
+	{
+		block=heapExtend(arena, size, &clean);
+	}
+	else if(size<=HEAP_MAX_BLOCK)
+	{
+		block=heapNew(arena);
+		clean=1;
+	}
+
+	if(block!=NULL)
+	{
+		split(arena, block, size, clean);
+		setInUse(block);
+	}
+	if(zero!=NULL)
+		*zero=clean;
+
+
+	return block;
+}
+
+/*
+ * Returns an in-use heap block to an arena whose lock is held. Whether the
+ * heap can give memory back depends on the merged block, not the freed one;
+ * a heap that is entirely free goes to heapTrim() whatever the threshold.
+ */
+static void arenaFree(Arena *arena, MemoryBlock *block)
+{
+	size_t size;
+	int zero=0;
+
+
+	block=coalesce(arena, block, &zero);
+	size=blockSize(block);
+	if(((block->size&NON_MAIN) && size<trimThreshold && size!=HEAP_MAX_BLOCK) || !heapTrim(arena, block))
+	{
+		setFree(block, zero);
+		binInsert(arena, block);
+	}
+
+
+	return;
+}
+
+
+/*
+ * Block size needed to hand out size bytes: header added, rounded up to the
+ * alignment and at least MIN_BLOCK. Returns 0 if the request is too big, that
+ * is past PTRDIFF_MAX as in glibc, which keeps the SAMPLED bit out of block
+ * sizes and every sbrk() increment positive.
+ */
+static size_t requestSize(size_t size)
+{
+	size_t rounded=(size+HEADER_SIZE+ALIGNMENT-1)&~(size_t)(ALIGNMENT-1);
+
+
+	if(rounded<=size || rounded>PTRDIFF_MAX)
+		rounded=0;
+	else if(rounded<MIN_BLOCK)
+		rounded=MIN_BLOCK;
+
+
+	return rounded;
+}
+
+/*
+ * Returns count blocks from the front of one of this thread's cache lists to
+ * their arenas. Consecutive blocks usually share an arena, so its lock is only
+ * dropped when the owner changes.
+ */
+static void tcacheFlush(int cls, int count)
+{
+	Arena *locked=NULL;
+
+
+	while(count>0 && tcache.lists[cls]!=NULL)
+	{
+		MemoryBlock *block=tcache.lists[cls];
+		Arena *arena=blockArena(block);
+
+		tcache.lists[cls]=block->next;
+		tcache.counts[cls]--;
+		count--;
+
+		if(arena!=locked)
+		{
+			if(locked!=NULL)
+				pthread_mutex_unlock(&locked->lock);
+			pthread_mutex_lock(&arena->lock);
+			locked=arena;
+		}
+		arenaFree(arena, block);
+	}
+
+	if(locked!=NULL)
+		pthread_mutex_unlock(&locked->lock);
+
+
+	return;
+}
+
+/*
+ * pthread key destructor, empties the cache of an exiting thread and moves its
+ * allocation counts over to retiredAllocs.
+ */
+static void tcacheDestroy(void *unused)
+{
+	int cls;
+
+	(void)unused;
+	for(cls=0; cls<SMALL_BINS; cls++)
+		tcacheFlush(cls, tcache.counts[cls]);
+	slabFlushThread();
+	traceFlush(&tcache);
+
+	pthread_mutex_lock(&initLock);
+	for(cls=0; cls<ALLOC_SIZE_CLASSES; cls++)
+	{
+		retiredAllocs[cls]+=tcache.allocs[cls];
+		tcache.allocs[cls]=0;
+	}
+	if(tcache.prevCache!=NULL)
+		tcache.prevCache->nextCache=tcache.nextCache;
+	else
+		caches=tcache.nextCache;
+	if(tcache.nextCache!=NULL)
+		tcache.nextCache->prevCache=tcache.prevCache;
+	pthread_mutex_unlock(&initLock);
+	tcache.initialized=0;
+
+
+	return;
+}
+
+//counts an allocation against its size class in this thread's cache
+static void countAlloc(MemoryBlock *block)
+{
+	if(block->size&MMAPPED)
+		tcache.allocs[MMAP_CLASS]++;
+	else
+		tcache.allocs[binIndex(blockSize(block))]++;
+
+
+	return;
+}
+
+//pushes a block onto this thread's cache list for its size class
+static void tcachePush(int cls, MemoryBlock *block)
+{
+	block->next=tcache.lists[cls];
+	block->prev=(MemoryBlock*)&tcache;	//marks it cached, to catch double frees
+	tcache.lists[cls]=block;
+	tcache.counts[cls]++;
+
+
+	return;
+}
+
+/*
+ * Refills an empty cache list with up to TCACHE_FILL blocks of exactly size
+ * bytes under a single lock: first whatever sits in the matching exact-fit
+ * bin, then pieces cut from one larger block.
+ */
+static void tcacheRefill(int cls, size_t size)
+{
+	Arena *arena=tcache.arena;
+	MemoryBlock *block;
+	int want=TCACHE_FILL;
+
+
+	pthread_mutex_lock(&arena->lock);
+	while(want>0 && (block=arena->bins[cls])!=NULL)
+	{
+		binRemove(arena, block);
+		setInUse(block);
+		tcachePush(cls, block);
+		want--;
+	}
+
+	if(want>0)
+	{
+		block=arenaAlloc(arena, size*want, NULL);
+		if(block==NULL)
+		{
+			want=1;
+			block=arenaAlloc(arena, size, NULL);
+		}
+
+		if(block!=NULL)
+		{
+			size_t left=blockSize(block);
+			size_t flags=block->size&(PREV_INUSE|NON_MAIN);
+
+			while(left>=2*size)
+			{
+				block->size=size|INUSE|flags;
+				tcachePush(cls, block);
+				block=nextBlock(block);
+				flags=PREV_INUSE|(flags&NON_MAIN);
+				left-=size;
+			}
+			block->size=left|INUSE|flags;	//the last piece keeps any slack
+			if(left<=SMALL_BIN_MAX)
+				tcachePush(binIndex(left), block);
+			else
+				arenaFree(arena, block);
+		}
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+
+	return;
+}
+
+
+//pops a small block of exactly size bytes off this thread's cache
+static MemoryBlock *tcacheAlloc(size_t size)
+{
+	int cls=binIndex(size);
+	MemoryBlock *block;
+
+
+	if(tcache.lists[cls]==NULL)
+		tcacheRefill(cls, size);
+
+	block=tcache.lists[cls];
+	if(block!=NULL)
+	{
+		tcache.lists[cls]=block->next;
+		tcache.counts[cls]--;
+		block->prev=NULL;	//no longer cached, spares free() the list walk
+	}
+
+
+	return block;
+}
+
+
+//writes out and empties a thread's trace buffer
+static void traceFlush(ThreadCache *cache)
+{
+	if(cache->traceCount>0)
+	{
+		pthread_mutex_lock(&traceLock);
+		if(traceFd>=0 && write(traceFd, cache->trace, cache->traceCount*sizeof(alloc_trace_t))<0)
+		{
+			close(traceFd);	//disk full or similar, stop tracing
+			traceFd=-1;
+		}
+		pthread_mutex_unlock(&traceLock);
+		cache->traceCount=0;
+	}
+
+
+	return;
+}
+
+/*
+ * Appends a call to this thread's trace buffer, unless it happens inside
+ * another traced call (calloc calling malloc, realloc calling free, ...).
+ * Frees are recorded before the block is released and the rest after the
+ * block is handed out, so a sequence number never shows an address in use
+ * twice.
+ */
+static void traceRecord(uint32_t op, void *ptr, uint64_t aux, size_t size)
+{
+	if(tcache.hookDepth==0)
+	{
+		alloc_trace_t *rec=&tcache.trace[tcache.traceCount++];
+
+		if(tcache.traceThread==0)
+			tcache.traceThread=__atomic_add_fetch(&traceThreads, 1, __ATOMIC_RELAXED);
+		rec->seq=__atomic_fetch_add(&traceSeq, 1, __ATOMIC_RELAXED);
+		rec->ptr=(uintptr_t)ptr;
+		rec->aux=aux;
+		rec->size=size;
+		rec->thread=tcache.traceThread;
+		rec->op=op;
+		if(tcache.traceCount==TRACE_BUFFER)
+			traceFlush(&tcache);
+	}
+
+
+	return;
+}
+
+//creates tracePrefix.<pid> and writes the header to it
+static void traceOpen()
+{
+	char path[4096];
+	alloc_trace_header_t header={ALLOC_TRACE_MAGIC, ALLOC_TRACE_VERSION,
+			sizeof(alloc_trace_t), (uint32_t)getpid()};
+
+
+	snprintf(path, sizeof(path), "%s.%d", tracePrefix, (int)getpid());
+	traceFd=open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if(traceFd>=0 && write(traceFd, &header, sizeof(header))!=(ssize_t)sizeof(header))
+	{
+		close(traceFd);
+		traceFd=-1;
+	}
+
+
+	return;
+}
+
+/*
+ * atexit handler, writes out what every thread still has buffered. Threads
+ * that keep allocating while the program exits may lose their last records.
+ */
+static void traceFinish()
+{
+	ThreadCache *itr;
+
+
+	traceFlush(&tcache);
+	pthread_mutex_lock(&initLock);
+	for(itr=caches; itr!=NULL; itr=itr->nextCache)
+		traceFlush(itr);
+	pthread_mutex_unlock(&initLock);
+
+
+	return;
+}
+
+
+//hash bucket of a live sample, the top 16 bits of a multiplicative hash
+#define sampleBucket(addr) ((int)((((uintptr_t)(addr))>>4)*0x9E3779B97F4A7C15ULL>>48))
+typedef char bucketsMatch[PROFILE_BUCKETS==1<<16 ? 1 : -1];
+
+/*
+ * Counts an allocation towards the next sample and takes the sample once the
+ * bytes are used up. This is all a call pays while the sample is not due yet,
+ * and with profiling off not even the count. Calls inside another hooked call
+ * are left to it.
+ */
+static inline void profileAlloc(void *addr, size_t size)
+{
+	if(profileRate!=0 && tcache.hookDepth==0 && (tcache.sampleLeft-=(long)size)<0)
+		profileSample(addr, size);
+
+
+	return;
+}
+
+/*
+ * Draws the number of bytes until the next sample from an exponential
+ * distribution with mean profileRate, so sampling cannot fall into step with
+ * the program's allocation pattern. -ln(u) is taken from the position of the
+ * leading one of a random 64-bit u plus a quadratic fit of log2 on the rest.
+ */
+static long sampleInterval()
+{
+	uint64_t x=tcache.sampleRand;
+	int lz;
+	double m, minusLog2;
+
+
+	x^=x<<13;
+	x^=x>>7;
+	x^=x<<17;
+	tcache.sampleRand=x;
+
+	lz=__builtin_clzll(x);
+	m=(double)(x<<lz<<1)/18446744073709551616.0;
+	minusLog2=(lz+1)-(m+0.3466*m*(1-m));
+
+
+	return (long)(minusLog2*0.6931471805599453*profileRate)+1;
+}
+
+//writes the whole buffer, retrying short writes
+static void writeAll(int fd, const char *buf, size_t len)
+{
+	ssize_t done;
+
+
+	while(len>0 && (done=write(fd, buf, len))>0)
+	{
+		buf+=done;
+		len-=done;
+	}
+
+
+	return;
+}
+
+/*
+ * Writes the live samples to profilePrefix.<pid>.<n>.heap in the legacy heap
+ * profile format (heap_v2, so pprof scales the samples back up by the rate),
+ * followed by the memory map pprof needs to symbolize the stacks. Formats into
+ * stack buffers and never allocates.
+ */
+static void profileDump()
+{
+	char path[4096];
+	char line[64+PROFILE_DEPTH*20];
+	unsigned long count=0;
+	size_t bytes=0;
+	int fd, maps, i, b, len;
+	Sample *itr;
+
+
+	pthread_mutex_lock(&profileLock);
+	snprintf(path, sizeof(path), "%s.%d.%u.heap", profilePrefix, (int)getpid(), profileDumps++);
+	fd=open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if(fd>=0)
+	{
+		for(b=0; b<PROFILE_BUCKETS; b++)
+		{
+			for(itr=samples[b]; itr!=NULL; itr=itr->next)
+			{
+				count++;
+				bytes+=itr->size;
+			}
+		}
+		len=snprintf(line, sizeof(line), "heap profile: %lu: %zu [%lu: %zu] @ heap_v2/%ld\n",
+				count, bytes, count, bytes, profileRate);
+		writeAll(fd, line, len);
+
+		for(b=0; b<PROFILE_BUCKETS; b++)
+		{
+			for(itr=samples[b]; itr!=NULL; itr=itr->next)
+			{
+				len=snprintf(line, sizeof(line), "1: %zu [1: %zu] @", itr->size, itr->size);
+				for(i=0; i<itr->depth; i++)
+					len+=snprintf(line+len, sizeof(line)-len, " %p", itr->stack[i]);
+				line[len++]='\n';
+				writeAll(fd, line, len);
+			}
+		}
+
+		writeAll(fd, "\nMAPPED_LIBRARIES:\n", sizeof("\nMAPPED_LIBRARIES:\n")-1);
+		maps=open("/proc/self/maps", O_RDONLY|O_CLOEXEC);
+		while(maps>=0 && (len=read(maps, line, sizeof(line)))>0)
+			writeAll(fd, line, len);
+		if(maps>=0)
+			close(maps);
+		close(fd);
+	}
+	pthread_mutex_unlock(&profileLock);
+
+
+	return;
+}
+
+//puts a sample in its bucket and tags its block
+static void profileHook(Sample *sample)
+{
+	int bucket=sampleBucket(sample->addr);
+
+
+	pthread_mutex_lock(&profileLock);
+	sample->next=samples[bucket];
+	samples[bucket]=sample;
+	pthread_mutex_unlock(&profileLock);
+	__atomic_or_fetch(&memToBlock((void*)sample->addr)->size, SAMPLED, __ATOMIC_RELAXED);
+
+
+	return;
+}
+
+/*
+ * Slow path of profileAlloc(). Starts a thread's sampling on its first call;
+ * after that it records the block with the stack that allocated it and draws
+ * the next interval.
+ */
+static void profileSample(void *addr, size_t size)
+{
+	Sample *sample=NULL;
+
+
+	if(profileRate==0)
+	{
+		tcache.sampleLeft=LONG_MAX;
+	}
+	else if(tcache.sampleRand==0)
+	{
+		tcache.sampleRand=((uintptr_t)&tcache^((uint64_t)getpid()<<32))|1;
+		tcache.sampleLeft=sampleInterval();
+	}
+	else
+	{
+		tcache.sampleLeft=sampleInterval();
+		if(addr!=NULL)
+			sample=slab_alloc(&sampleSlab);
+	}
+
+	if(sample!=NULL)
+	{
+		tcache.hookDepth++;	//backtrace may allocate the first time around
+		sample->depth=backtrace(sample->stack, PROFILE_DEPTH);
+		tcache.hookDepth--;
+		sample->addr=(uintptr_t)addr;
+		sample->size=size;
+		profileHook(sample);
+	}
+
+
+	return;
+}
+
+/*
+ * Drops the sample of a block that is being freed, if it has one. The flag
+ * sits in the size free() reads anyway, so an unsampled block costs one test.
+ */
+static inline void profileFree(void *ptr)
+{
+	if(memToBlock(ptr)->size&SAMPLED)
+		profileDrop(ptr);
+
+
+	return;
+}
+
+//takes a tagged block's sample out of its bucket and clears the tag, undone by profileHook()
+static Sample *profileUnhook(void *ptr)
+{
+	Sample **link;
+	Sample *found=NULL;
+	int bucket=sampleBucket(ptr);
+
+
+	__atomic_and_fetch(&memToBlock(ptr)->size, ~SAMPLED, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&profileLock);
+	for(link=&samples[bucket]; found==NULL && *link!=NULL; link=&(*link)->next)
+	{
+		if((*link)->addr==(uintptr_t)ptr)
+		{
+			found=*link;
+			*link=found->next;
+		}
+	}
+	pthread_mutex_unlock(&profileLock);
+
+
+	return found;
+}
+
+//slow path of profileFree()
+static void profileDrop(void *ptr)
+{
+	Sample *sample=profileUnhook(ptr);
+
+
+	if(sample!=NULL)
+		slab_free(&sampleSlab, sample);
+
+
+	return;
+}
+
+/*
+ * The dump signal only wakes the dump thread, since the handler may have
+ * interrupted a thread that holds profileLock. The pipe does not block, so a
+ * burst of signals that fills it loses the extra dumps and nothing else.
+ */
+static void profileSignal(int sig)
+{
+	int saved=errno;
+	char byte=(char)sig;
+	ssize_t sent;
+
+
+	sent=write(profilePipe[1], &byte, 1);	//fails only when the pipe is full of dumps already
+	(void)sent;
+	errno=saved;
+
+
+	return;
+}
+
+//writes one dump per byte the signal handler sends, so an idle process still answers
+static void *profileThread(void *unused)
+{
+	char buf[16];
+	ssize_t len;
+	int i;
+
+	(void)unused;
+	while((len=read(profilePipe[0], buf, sizeof(buf)))>0 || (len<0 && errno==EINTR))
+	{
+		for(i=0; i<len; i++)
+			profileDump();
+	}
+
+
+	return NULL;
+}
+
+/*
+ * Opens the pipe to the dump thread and starts the thread with every signal
+ * blocked, so it never takes one meant for the program. Run again in a forked
+ * child, which gets the pipe but not the thread. If either fails the signal
+ * is simply ignored.
+ */
+static void profileStart()
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t all, old;
+
+
+	if(pipe2(profilePipe, O_CLOEXEC)==0)
+	{
+		fcntl(profilePipe[1], F_SETFL, O_NONBLOCK);
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pthread_create(&tid, &attr, profileThread, NULL);
+		pthread_attr_destroy(&attr);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+
+	return;
+}
+
+//atexit handler, writes the final profile
+static void profileFinish()
+{
+	profileDump();
+
+
+	return;
+}
+
+
+/*
+ * Huge page mode needs transparent huge pages that are not switched off
+ * (either "always" or "madvise" will do).
+ */
+static int thpAvailable()
+{
+	char buf[128];
+	int fd=open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY|O_CLOEXEC);
+	ssize_t len=fd>=0 ? read(fd, buf, sizeof(buf)-1) : -1;
+
+
+	if(fd>=0)
+		close(fd);
+	if(len>0)
+		buf[len]='\0';
+
+
+	return len>0 && strstr(buf, "[never]")==NULL;
+}
+
+
+//fork handlers, so a child never inherits an arena or slab cache locked by another thread
+static void forkPrepare()
+{
+	int i;
+	slab_t *s;
+
+	pthread_mutex_lock(&initLock);
+	for(i=0; i<arenaCount; i++)
+		pthread_mutex_lock(&arenas[i].lock);
+	pthread_mutex_lock(&traceLock);
+	pthread_mutex_lock(&profileLock);
+	for(s=slabList; s!=NULL; s=s->next)
+		pthread_mutex_lock(&s->lock);
+
+
+	return;
+}
+
+static void forkParent()
+{
+	int i;
+	slab_t *s;
+
+	for(s=slabList; s!=NULL; s=s->next)
+		pthread_mutex_unlock(&s->lock);
+	pthread_mutex_unlock(&profileLock);
+	pthread_mutex_unlock(&traceLock);
+	for(i=0; i<arenaCount; i++)
+		pthread_mutex_unlock(&arenas[i].lock);
+	pthread_mutex_unlock(&initLock);
+
+
+	return;
+}
+
+/*
+ * In the child the locks are reset, and a traced child gets a trace file of
+ * its own. Buffered records belong to the parent, which writes them itself.
+ * A profiled child gets a dump thread of its own too.
+ */
+static void forkChild()
+{
+	int i;
+	ThreadCache *itr;
+	slab_t *s;
+
+	for(i=0; i<arenaCount; i++)
+		pthread_mutex_init(&arenas[i].lock, NULL);
+	pthread_mutex_init(&initLock, NULL);
+	pthread_mutex_init(&traceLock, NULL);
+	pthread_mutex_init(&profileLock, NULL);
+	for(s=slabList; s!=NULL; s=s->next)
+		pthread_mutex_init(&s->lock, NULL);
+
+	if(traceFd>=0)
+	{
+		close(traceFd);
+		traceOpen();
+		tcache.traceCount=0;
+		for(itr=caches; itr!=NULL; itr=itr->nextCache)
+			itr->traceCount=0;
+	}
+
+	if(profilePipe[0]>=0)
+	{
+		close(profilePipe[0]);
+		close(profilePipe[1]);
+		profileStart();
+	}
+
+
+	return;
+}
+
+/*
+ * Reads the tunables from the environment the first time anything is
+ * allocated. ALLOC_ARENAS caps the number of arenas, which defaults to one per
+ * online CPU, ALLOC_STATS prints malloc_stats() when the program exits and
+ * ALLOC_TRACE=prefix records every call to prefix.<pid>. ALLOC_HUGEPAGES
+ * moves the main arena off sbrk onto 2 MB-aligned heaps that, like big mapped
+ * blocks, are backed by transparent huge pages. ALLOC_PROFILE=prefix
+ * samples one allocation per ALLOC_PROFILE_RATE bytes and dumps the live ones
+ * at exit and, from a thread of its own, on ALLOC_PROFILE_SIGNAL (SIGUSR2
+ * unless set).
+ */
+static void allocInit()
+{
+	char *env;
+	long cpus;
+	int first=0;
+
+
+	pthread_mutex_lock(&initLock);
+	if(!initialized)
+	{
+		initialized=1;	//set first, the calls below may allocate
+		first=1;
+		pageSize=(size_t)sysconf(_SC_PAGESIZE);
+		if((env=getenv("ALLOC_MMAP_THRESHOLD"))!=NULL)
+		{
+			mmapThreshold=strtoul(env, NULL, 10);
+			thresholdsPinned=1;
+		}
+		if((env=getenv("ALLOC_TRIM_THRESHOLD"))!=NULL)
+		{
+			trimThreshold=strtoul(env, NULL, 10);
+			thresholdsPinned=1;
+		}
+		if(getenv("ALLOC_STATS")!=NULL)
+			dumpStats=1;
+		tracePrefix=getenv("ALLOC_TRACE");
+		if(getenv("ALLOC_HUGEPAGES")!=NULL)
+			hugePages=thpAvailable();
+		profilePrefix=getenv("ALLOC_PROFILE");
+		pthread_key_create(&cacheKey, tcacheDestroy);
+	}
+	pthread_mutex_unlock(&initLock);
+
+	//these may call back into malloc, so initLock must not be held
+	if(first)
+	{
+		cpus=sysconf(_SC_NPROCESSORS_ONLN);
+		if((env=getenv("ALLOC_ARENAS"))!=NULL)
+			cpus=strtol(env, NULL, 10);
+		arenaLimit=cpus<1 ? 1 : (cpus>MAX_ARENAS ? MAX_ARENAS : (int)cpus);
+
+		pthread_atfork(forkPrepare, forkParent, forkChild);
+		if(dumpStats)
+			atexit(malloc_stats);
+		if(tracePrefix!=NULL)
+		{
+			traceOpen();
+			if(traceFd>=0)
+				atexit(traceFinish);
+		}
+		if(profilePrefix!=NULL)
+		{
+			struct sigaction act;
+			void *frame;
+			long rate=PROFILE_RATE;
+			int sig=SIGUSR2;
+
+			if((env=getenv("ALLOC_PROFILE_RATE"))!=NULL)
+				rate=strtol(env, NULL, 10);
+			if((env=getenv("ALLOC_PROFILE_SIGNAL"))!=NULL)
+				sig=(int)strtol(env, NULL, 10);
+
+			//what backtrace allocates while loading the unwinder must not
+			//reach profileSample, which would turn sampling off for good
+			tcache.hookDepth++;
+			slab_init(&sampleSlab, sizeof(Sample));
+			backtrace(&frame, 1);
+			profileStart();
+			memset(&act, 0, sizeof(act));
+			act.sa_handler=profileSignal;
+			act.sa_flags=SA_RESTART;
+			sigaction(sig, &act, NULL);
+			atexit(profileFinish);
+			profileRate=rate>0 ? rate : PROFILE_RATE;
+			tcache.hookDepth--;
+		}
+	}
+
+
+	return;
+}
+
+/*
+ * Sets up the calling thread's cache and picks its arena round-robin, so the
+ * first thread gets the main arena and later ones spread over arenaLimit.
+ */
+static void threadInit()
+{
+	unsigned int index;
+
+
+	tcache.initialized=1;	//set first, pthread_setspecific may allocate
+	pthread_mutex_lock(&initLock);
+	index=arenaNext++%(unsigned int)arenaLimit;
+	while(arenaCount<=(int)index)
+	{
+		pthread_mutex_init(&arenas[arenaCount].lock, NULL);
+		arenaCount++;
+	}
+	tcache.prevCache=NULL;
+	tcache.nextCache=caches;
+	if(caches!=NULL)
+		caches->prevCache=&tcache;
+	caches=&tcache;
+	pthread_mutex_unlock(&initLock);
+
+	tcache.arena=&arenas[index];
+	pthread_setspecific(cacheKey, &tcache);
+
+
+	return;
+}
+
+//rounds a mapping length up to whole pages, 0 if that would overflow
+static size_t pageRound(size_t size)
+{
+	size_t rounded=(size+pageSize-1)&~(pageSize-1);
+
+
+	return rounded>=size ? rounded : 0;
+}
+
+/*
+ * Gives a block of at least size bytes its own anonymous mapping. The header
+ * sits at the start of the mapping, so prevSize (the offset back to the start
+ * of the mapping) is 0. In huge page mode a block of a huge page or more is
+ * a big buffer that usually lives long, so its data is aligned to 2 MB and
+ * advised to use huge pages instead.
+ */
+static MemoryBlock *mmapBlock(size_t size)
+{
+	MemoryBlock *block=NULL;
+	size_t length=pageRound(size);
+	void *map=MAP_FAILED;
+
+
+	if(hugePages && size>=HUGE_PAGE)
+	{
+		//the whole mapping, a partly advised one is split and mremap fails on it
+		block=mmapAligned(HUGE_PAGE, size);
+		if(block!=NULL)
+			hugeAdvise((char*)block-block->prevSize, blockSize(block)+block->prevSize);
+	}
+	else if(length!=0)
+	{
+		map=osMap(length, 0, &statMapped);
+	}
+
+	if(map!=MAP_FAILED)
+	{
+		block=map;
+		block->prevSize=0;
+		block->size=length|MMAPPED|INUSE;
+	}
+
+
+	return block;
+}
+
+/*
+ * Unmaps an mmapped block straight away and slides the thresholds so buffers
+ * of this size are served from the heap next time.
+ */
+static void munmapBlock(MemoryBlock *block)
+{
+	size_t size=blockSize(block);
+
+
+	if(!thresholdsPinned && size>mmapThreshold && size<=MAX_MMAP_THRESHOLD)
+	{
+		mmapThreshold=size;
+		trimThreshold=2*size;
+	}
+	osUnmap((char*)block-block->prevSize, size+block->prevSize, &statMapped);
+
+
+	return;
+}
+
+/*
+ * Resizes an mmapped block with mremap, letting the kernel move the pages
+ * instead of copying them; shrinking unmaps the tail pages. Returns NULL if
+ * the mapping could not be resized.
+ */
+static MemoryBlock *mremapBlock(MemoryBlock *block, size_t size)
+{
+	MemoryBlock *moved=NULL;
+	size_t offset=block->prevSize;
+	size_t oldLength=blockSize(block)+offset;
+	size_t length=pageRound(size+offset);
+	char *map=MAP_FAILED;
+
+
+	if(length==oldLength)
+		moved=block;
+	else if(length!=0)
+		map=mremap((char*)block-offset, oldLength, length, MREMAP_MAYMOVE);
+
+	if(map!=MAP_FAILED)
+	{
+		__atomic_add_fetch(&statMremap, 1, __ATOMIC_RELAXED);
+		statFootprint(&statMapped, length-oldLength);
+		moved=(MemoryBlock*)(map+offset);
+		moved->size=(length-offset)|MMAPPED|INUSE;
+	}
+
+
+	return moved;
+}
+
+
+/**
+ * Allocate space for array in memory
+ *
+ * Allocates a block of memory for an array of num elements, each of them size
+ * bytes long, and initializes all its bits to zero. The effective result is
+ * the allocation of an zero-initialized memory block of (num * size) bytes.
+ *
+ * @param num
+ *    Number of elements to be allocated.
+ * @param size
+ *    Size of elements.
+ *
+ * @return
+ *    A pointer to the memory block allocated by the function.
+ *
+ *    The type of this pointer is always void*, which can be cast to the
+ *    desired type of data pointer in order to be dereferenceable.
+ *
+ *    If the function failed to allocate the requested block of memory, a
+ *    NULL pointer is returned.
+ *
+ * @see http://www.cplusplus.com/reference/clibrary/cstdlib/calloc/
+ */
+void *calloc(size_t num, size_t size)
+{
+	void *ptr=NULL;
+	size_t total=num*size;
+	size_t rounded=requestSize(total);
+	MemoryBlock *block=NULL;
+	int zero=0;
+
+
+	if(!initialized)
+		allocInit();
+	if(!tcache.initialized)
+		threadInit();
+
+	if((size!=0 && total/size!=num) || rounded==0)
+	{
+		ptr=NULL;
+	}
+	else if(rounded>=CALLOC_MMAP_THRESHOLD || rounded>=mmapThreshold || rounded>HEAP_MAX_BLOCK)
+	{
+		//fresh pages are zero and stay untouched until the caller uses them
+		block=mmapBlock(rounded);
+		if(block!=NULL)
+		{
+			countAlloc(block);
+			ptr=blockToMem(block);
+		}
+	}
+	else if(rounded>SMALL_BIN_MAX)
+	{
+		pthread_mutex_lock(&tcache.arena->lock);
+		block=arenaAlloc(tcache.arena, rounded, &zero);
+		pthread_mutex_unlock(&tcache.arena->lock);
+
+		if(block!=NULL)
+		{
+			countAlloc(block);
+			ptr=blockToMem(block);
+			//a zeroed block only has its old list links to clear
+			memset(ptr, 0x00, zero ? 2*sizeof(void*) : total);
+		}
+	}
+	else
+	{
+		//not malloc(), GCC would turn malloc+memset back into a call to calloc
+		block=tcacheAlloc(rounded);
+		if(block!=NULL)
+		{
+			countAlloc(block);
+			ptr=blockToMem(block);
+			memset(ptr, 0x00, total);
+		}
+	}
+
+	if(traceFd>=0)
+		traceRecord(TRACE_CALLOC, ptr, num, size);
+	profileAlloc(ptr, total);
+
+
+	return ptr;
+}
+
+
+/**
+ * Allocate memory block
+ *
+ * Allocates a block of size bytes of memory, returning a pointer to the
+ * beginning of the block.  The content of the newly allocated block of
+ * memory is not initialized, remaining with indeterminate values.
+ *
+ * @param size
+ *    Size of the memory block, in bytes.
+ *
+ * @return
+ *    On success, a pointer to the memory block allocated by the function.
+ *
+ *    The type of this pointer is always void*, which can be cast to the
+ *    desired type of data pointer in order to be dereferenceable.
+ *
+ *    If the function failed to allocate the requested block of memory,
+ *    a null pointer is returned.
+ *
+ * @see http://www.cplusplus.com/reference/clibrary/cstdlib/malloc/
+ */
+void *malloc(size_t size)
+{
+	void *addr=NULL;
+	size_t rounded=requestSize(size);
+	MemoryBlock *block=NULL;
+
+
+	if(!initialized)
+		allocInit();
+	if(!tcache.initialized)
+		threadInit();
+
+	if(rounded==0)
+	{
+		block=NULL;
+	}
+	else if(rounded>=mmapThreshold || rounded>HEAP_MAX_BLOCK)
+	{
+		block=mmapBlock(rounded);
+	}
+	else if(rounded<=SMALL_BIN_MAX)
+	{
+		block=tcacheAlloc(rounded);
+	}
+	else
+	{
+		pthread_mutex_lock(&tcache.arena->lock);
+		block=arenaAlloc(tcache.arena, rounded, NULL);
+		pthread_mutex_unlock(&tcache.arena->lock);
+	}
+
+	if(block!=NULL)
+	{
+		countAlloc(block);
+		addr=blockToMem(block);
+	}
+
+	if(traceFd>=0)
+		traceRecord(TRACE_MALLOC, addr, 0, size);
+	profileAlloc(addr, size);
+
+
+	return addr;
+}
+
+
+/**
+ * Deallocate space in memory
+ *
+ * A block of memory previously allocated using a call to malloc(),
+ * calloc() or realloc() is deallocated, making it available again for
+ * further allocations.
+ *
+ * Notice that this function leaves the value of ptr unchanged, hence
+ * it still points to the same (now invalid) location, and not to the
+ * null pointer.
+ *
+ * @param ptr
+ *    Pointer to a memory block previously allocated with malloc(),
+ *    calloc() or realloc() to be deallocated.  If a null pointer is
+ *    passed as argument, no action occurs.
+ */
+void free(void *ptr)
+{
+	// "If a null pointer is passed as argument, no action occurs."
+	if (ptr!=NULL)//changed from original "if" because mult. returns is bad
+	{
+		MemoryBlock *block=memToBlock(ptr);
+		size_t size=blockSize(block);
+
+		if(traceFd>=0)
+			traceRecord(TRACE_FREE, ptr, 0, 0);
+		profileFree(ptr);
+		if(block->size&MMAPPED)
+		{
+			munmapBlock(block);
+		}
+		else if(!(block->size&INUSE))
+		{
+			//ignore double frees
+		}
+		else if(size<=SMALL_BIN_MAX && tcache.initialized)
+		{
+			int cls=binIndex(size);
+			MemoryBlock *itr=NULL;
+
+			if(block->prev==(MemoryBlock*)&tcache)//maybe cached already
+			{
+				for(itr=tcache.lists[cls]; itr!=NULL && itr!=block; itr=itr->next)
+					;
+			}
+
+			if(itr==NULL)
+			{
+				tcachePush(cls, block);
+				if(tcache.counts[cls]>TCACHE_MAX)
+					tcacheFlush(cls, TCACHE_MAX/2);
+			}
+		}
+		else
+		{
+			Arena *arena=blockArena(block);
+			pthread_mutex_lock(&arena->lock);
+			arenaFree(arena, block);
+			pthread_mutex_unlock(&arena->lock);
+		}
+	}
+
+	return;
+}
+
+
+/**
+ * Reallocate memory block
+ *
+ * The size of the memory block pointed to by the ptr parameter is changed
+ * to the size bytes, expanding or reducing the amount of memory available
+ * in the block.
+ *
+ * The function may move the memory block to a new location, in which case
+ * the new location is returned. The content of the memory block is preserved
+ * up to the lesser of the new and old sizes, even if the block is moved. If
+ * the new size is larger, the value of the newly allocated portion is
+ * indeterminate.
+ *
+ * In case that ptr is NULL, the function behaves exactly as malloc, assigning
+ * a new block of size bytes and returning a pointer to the beginning of it.
+ *
+ * In case that the size is 0, the memory previously allocated in ptr is
+ * deallocated as if a call to free was made, and a NULL pointer is returned.
+ *
+ * @param ptr
+ *    Pointer to a memory block previously allocated with malloc(), calloc()
+ *    or realloc() to be reallocated.
+ *
+ *    If this is NULL, a new block is allocated and a pointer to it is
+ *    returned by the function.
+ *
+ * @param size
+ *    New size for the memory block, in bytes.
+ *
+ *    If it is 0 and ptr points to an existing block of memory, the memory
+ *    block pointed by ptr is deallocated and a NULL pointer is returned.
+ *
+ * @return
+ *    A pointer to the reallocated memory block, which may be either the
+ *    same as the ptr argument or a new location.
+ *
+ *    The type of this pointer is void*, which can be cast to the desired
+ *    type of data pointer in order to be dereferenceable.
+ *
+ *    If the function failed to allocate the requested block of memory,
+ *    a NULL pointer is returned, and the memory block pointed to by
+ *    argument ptr is left unchanged.
+ *
+ * @see http://www.cplusplus.com/reference/clibrary/cstdlib/realloc/
+ */
+void *realloc(void *ptr, size_t size)
+{
+	void *addr=NULL;
+	Sample *sample=NULL;
+
+
+	//to the profiler a reallocated block is a new one, even if it stays put,
+	//but the old one keeps its sample until it has really been replaced
+	if(ptr!=NULL && (memToBlock(ptr)->size&SAMPLED))
+		sample=profileUnhook(ptr);
+
+	tcache.hookDepth++;
+	// "In case that ptr is NULL, the function behaves exactly as malloc()"
+	if (ptr==NULL)
+	{
+		addr=malloc(size);
+	}
+	// "In case that the size is 0, the memory previously allocated in ptr
+	//  is deallocated as if a call to free() was made, and a NULL pointer
+	//  is returned."
+	else if (size==0)
+	{
+		free(ptr);
+	}
+	else
+	{
+		MemoryBlock *block=memToBlock(ptr);
+		size_t usable=blockSize(block)-HEADER_SIZE;
+		size_t rounded=requestSize(size);
+
+		if(rounded==0)
+		{
+			addr=NULL;
+		}
+		else if(block->size&MMAPPED)
+		{
+			block=mremapBlock(block, rounded);
+			if(block!=NULL)
+				addr=blockToMem(block);
+		}
+		else if(rounded<=blockSize(block))
+		{
+			//shrink in place, the tail goes back to a bin if it can be a block
+			if(blockSize(block)-rounded>=MIN_BLOCK)
+			{
+				Arena *arena=blockArena(block);
+				pthread_mutex_lock(&arena->lock);
+				split(arena, block, rounded, 0);
+				pthread_mutex_unlock(&arena->lock);
+			}
+			addr=ptr;
+		}
+		else
+		{
+			Arena *arena=blockArena(block);
+			int grown;
+
+			pthread_mutex_lock(&arena->lock);
+			grown=growInPlace(arena, block, rounded);
+			pthread_mutex_unlock(&arena->lock);
+
+			if(grown)
+			{
+				addr=ptr;
+			}
+			else
+			{
+				addr=malloc(size);
+				if(addr!=NULL)
+				{
+					memcpy(addr, ptr, usable);
+					free(ptr);
+				}
+			}
+		}
+	}
+	tcache.hookDepth--;
+
+	if(sample!=NULL && addr==NULL && size!=0)
+		profileHook(sample);	//failed, ptr is untouched
+	else if(sample!=NULL)
+		slab_free(&sampleSlab, sample);
+
+	if(traceFd>=0)
+		traceRecord(TRACE_REALLOC, addr, (uintptr_t)ptr, size);
+	profileAlloc(addr, size);
+
+
+	return addr;
+}
+
+
+/*
+ * Like mmapBlock(), but the user pointer is aligned to alignment bytes. Whole
+ * pages in front of and behind the aligned block are unmapped again, and the
+ * header keeps the remaining offset to the start of the mapping in prevSize.
+ */
+static MemoryBlock *mmapAligned(size_t alignment, size_t size)
+{
+	MemoryBlock *block=NULL;
+	size_t length=size+alignment>size ? pageRound(size+alignment) : 0;
+	char *map=MAP_FAILED;
+
+
+	if(length!=0)
+		map=osMap(length, 0, NULL);
+
+	if(map!=MAP_FAILED)
+	{
+		uintptr_t mem=((uintptr_t)map+HEADER_SIZE+alignment-1)&~(uintptr_t)(alignment-1);
+		char *start=(char*)((mem-HEADER_SIZE)&~(uintptr_t)(pageSize-1));
+		char *end=(char*)pageRound(mem-HEADER_SIZE+size);
+
+		if(start>map)
+			osUnmap(map, start-map, NULL);
+		if(end<map+length)
+			osUnmap(end, map+length-end, NULL);
+		statFootprint(&statMapped, end-start);
+
+		block=memToBlock(mem);
+		block->prevSize=(char*)block-start;
+		block->size=(size_t)(end-(char*)block)|MMAPPED|INUSE;
+	}
+
+
+	return block;
+}
+
+/*
+ * Hands out a block whose user pointer is aligned to alignment, a power of two
+ * larger than ALIGNMENT. Heap requests are over-allocated by alignment plus a
+ * minimum block, the aligned block is cut out of the middle and both the lead
+ * and the tail go straight back to the bins, so only the header is kept.
+ */
+static void *alignedAlloc(size_t alignment, size_t size)
+{
+	void *addr=NULL;
+	size_t rounded=requestSize(size);
+	size_t padded=rounded+alignment+MIN_BLOCK;
+	MemoryBlock *block=NULL;
+
+
+	if(!initialized)
+		allocInit();
+	if(!tcache.initialized)
+		threadInit();
+
+	if(rounded==0 || padded<rounded)
+	{
+		block=NULL;
+	}
+	else if(padded>=mmapThreshold || padded>HEAP_MAX_BLOCK)
+	{
+		block=mmapAligned(alignment, rounded);
+	}
+	else
+	{
+		Arena *arena=tcache.arena;
+
+		pthread_mutex_lock(&arena->lock);
+		block=arenaAlloc(arena, padded, NULL);
+		if(block!=NULL)
+		{
+			uintptr_t mem=((uintptr_t)blockToMem(block)+alignment-1)&~(uintptr_t)(alignment-1);
+			size_t lead=(char*)memToBlock(mem)-(char*)block;
+
+			if(lead!=0 && lead<MIN_BLOCK)//the lead has to be a block of its own
+			{
+				mem+=alignment;
+				lead+=alignment;
+			}
+
+			if(lead!=0)
+			{
+				MemoryBlock *aligned=memToBlock(mem);
+				size_t flags=block->size&NON_MAIN;
+
+				aligned->size=(blockSize(block)-lead)|INUSE|PREV_INUSE|flags;
+				block->size=lead|INUSE|(block->size&(PREV_INUSE|NON_MAIN));
+				arenaFree(arena, block);
+				block=aligned;
+			}
+			split(arena, block, rounded, 0);
+		}
+		pthread_mutex_unlock(&arena->lock);
+	}
+
+	if(block!=NULL)
+	{
+		countAlloc(block);
+		addr=blockToMem(block);
+	}
+
+
+	return addr;
+}
+
+
+/**
+ * Allocate aligned memory
+ *
+ * Allocates size bytes and places the address of the allocated memory in
+ * *memptr. The address is a multiple of alignment, which must be a power of
+ * two and a multiple of sizeof(void*).
+ *
+ * @param memptr
+ *    Where the address of the allocated memory is stored.
+ * @param alignment
+ *    Required alignment of the address, in bytes.
+ * @param size
+ *    Size of the memory block, in bytes.
+ *
+ * @return
+ *    0 on success, EINVAL if alignment is not valid or ENOMEM if there was
+ *    not enough memory. *memptr is left unchanged on failure.
+ *
+ * @see http://pubs.opengroup.org/onlinepubs/9699919799/functions/posix_memalign.html
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	int rv=0;
+	void *addr;
+
+
+	if(alignment%sizeof(void*)!=0 || (alignment&(alignment-1))!=0 || alignment==0)
+	{
+		rv=EINVAL;
+	}
+	else
+	{
+		tcache.hookDepth++;
+		addr=alignment<=ALIGNMENT ? malloc(size) : alignedAlloc(alignment, size);
+		tcache.hookDepth--;
+		if(addr!=NULL)
+			*memptr=addr;
+		else
+			rv=ENOMEM;
+		if(traceFd>=0)
+			traceRecord(TRACE_MEMALIGN, addr, alignment, size);
+		profileAlloc(addr, size);
+	}
+
+
+	return rv;
+}
+
+/**
+ * Allocate memory aligned to alignment bytes, which must be a power of two.
+ * Returns NULL and sets errno to EINVAL if it is not.
+ *
+ * @see http://en.cppreference.com/w/c/memory/aligned_alloc
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	void *addr=NULL;
+
+
+	tcache.hookDepth++;
+	if(alignment==0 || (alignment&(alignment-1))!=0)
+		errno=EINVAL;
+	else if(alignment<=ALIGNMENT)
+		addr=malloc(size);
+	else
+		addr=alignedAlloc(alignment, size);
+	tcache.hookDepth--;
+
+	if(traceFd>=0)
+		traceRecord(TRACE_MEMALIGN, addr, alignment, size);
+	profileAlloc(addr, size);
+
+
+	return addr;
+}
+
+/**
+ * Obsolete form of aligned_alloc(). Like glibc, an alignment that is not a
+ * power of two is rounded up to the next one.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+	void *addr=NULL;
+	size_t pow=ALIGNMENT;
+
+
+	while(pow<alignment && pow!=0)
+		pow<<=1;
+
+	tcache.hookDepth++;
+	if(pow==0)
+		errno=EINVAL;
+	else if(pow==ALIGNMENT)
+		addr=malloc(size);
+	else
+		addr=alignedAlloc(pow, size);
+	tcache.hookDepth--;
+
+	if(traceFd>=0)
+		traceRecord(TRACE_MEMALIGN, addr, pow, size);
+	profileAlloc(addr, size);
+
+
+	return addr;
+}
+
+/**
+ * Allocates size bytes aligned to the page size.
+ */
+void *valloc(size_t size)
+{
+	if(!initialized)
+		allocInit();
+
+
+	return memalign(pageSize, size);
+}
+
+/**
+ * Allocates size bytes rounded up to whole pages, aligned to the page size.
+ */
+void *pvalloc(size_t size)
+{
+	void *addr=NULL;
+
+
+	if(!initialized)
+		allocInit();
+	if(pageRound(size)!=0 || size==0)
+		addr=memalign(pageSize, pageRound(size));
+
+
+	return addr;
+}
+
+/**
+ * Returns how many bytes can really be used at ptr, which is at least what
+ * was asked of malloc() and friends. 0 if ptr is NULL.
+ */
+size_t malloc_usable_size(void *ptr)
+{
+	size_t size=0;
+
+
+	if(ptr!=NULL)
+		size=blockSize(memToBlock(ptr))-HEADER_SIZE;
+
+
+	return size;
+}
+
+
+/*
+ * Maps one more chunk for a slab cache whose lock is held and threads its
+ * objects onto the free list. The first ALIGNMENT bytes of a chunk link it
+ * into the cache's chunk list.
+ */
+static int slabGrow(slab_t *s)
+{
+	int grown=0;
+	char *chunk=osMap(s->chunkSize, 0, &statMapped);
+
+
+	if(chunk!=MAP_FAILED)
+	{
+		char *obj;
+
+		*(void**)chunk=s->chunks;
+		s->chunks=chunk;
+		for(obj=chunk+ALIGNMENT; obj+s->objSize<=chunk+s->chunkSize; obj+=s->objSize)
+		{
+			*(void**)obj=s->freeList;
+			s->freeList=obj;
+		}
+		grown=1;
+	}
+
+
+	return grown;
+}
+
+//pops an object off the shared free list of a cache whose lock is held
+static void *slabTake(slab_t *s)
+{
+	void *obj=NULL;
+
+
+	if(s->freeList!=NULL || slabGrow(s))
+	{
+		obj=s->freeList;
+		s->freeList=*(void**)obj;
+	}
+
+
+	return obj;
+}
+
+/*
+ * Returns the calling thread's magazine for a cache, emptying it first if it
+ * still holds objects of a destroyed cache that had the same id. NULL if the
+ * cache did not get an id.
+ */
+static SlabMagazine *slabMagazine(slab_t *s)
+{
+	SlabMagazine *mag=NULL;
+
+
+	if(s->id>=0)
+	{
+		mag=&magazines[s->id];
+		if(mag->cache!=s || mag->gen!=s->gen)
+		{
+			mag->cache=s;
+			mag->gen=s->gen;
+			mag->count=0;
+		}
+	}
+
+
+	return mag;
+}
+
+/*
+ * Hands every magazine of an exiting thread back to its cache, skipping the
+ * ones whose cache has been destroyed since.
+ */
+static void slabFlushThread()
+{
+	int id;
+
+
+	pthread_mutex_lock(&initLock);
+	for(id=0; id<SLAB_MAX_CACHES; id++)
+	{
+		SlabMagazine *mag=&magazines[id];
+		slab_t *s=mag->cache;
+
+		if(mag->count>0 && slabCaches[id]==s && s->gen==mag->gen)
+		{
+			pthread_mutex_lock(&s->lock);
+			while(mag->count>0)
+			{
+				void *obj=mag->objs[--mag->count];
+				*(void**)obj=s->freeList;
+				s->freeList=obj;
+			}
+			pthread_mutex_unlock(&s->lock);
+		}
+		mag->count=0;
+	}
+	pthread_mutex_unlock(&initLock);
+
 
-MemoryBlock *memTable=NULL; // Dummy Node
+	return;
+}
 
 
 /**
- * Allocate space for array in memory
+ * Initializes a slab cache for objects of size bytes.
  *
- * Allocates a block of memory for an array of num elements, each of them size
- * bytes long, and initializes all its bits to zero. The effective result is
- * the allocation of an zero-initialized memory block of (num * size) bytes.
+ * Objects are 16-byte aligned. Memory is only mapped on the first
+ * slab_alloc() and is returned to the system by slab_destroy().
  *
- * @param num
- *    Number of elements to be allocated.
+ * @param s
+ *    The cache to initialize.
  * @param size
- *    Size of elements.
- *
- * @return
- *    A pointer to the memory block allocated by the function.
- *
- *    The type of this pointer is always void*, which can be cast to the
- *    desired type of data pointer in order to be dereferenceable.
- *
- *    If the function failed to allocate the requested block of memory, a
- *    NULL pointer is returned.
- *
- * @see http://www.cplusplus.com/reference/clibrary/cstdlib/calloc/
+ *    Size of every object handed out by this cache, in bytes.
  */
-void *calloc(size_t num, size_t size)
+void slab_init(slab_t *s, size_t size)
 {
-	/* Note: This function is complete. You do not need to modify it. */
-	void *ptr = malloc(num * size);
+	int id;
 
-	if (ptr)
-		memset(ptr, 0x00, num * size);
 
-	return ptr;
-}
+	if(!initialized)
+		allocInit();
+
+	s->objSize=(size+ALIGNMENT-1)&~(size_t)(ALIGNMENT-1);
+	if(s->objSize==0)
+		s->objSize=ALIGNMENT;
+	s->chunkSize=pageRound(ALIGNMENT+8*s->objSize);
+	if(s->chunkSize<SLAB_CHUNK)
+		s->chunkSize=SLAB_CHUNK;
+	s->freeList=NULL;
+	s->chunks=NULL;
+	s->id=-1;
+	pthread_mutex_init(&s->lock, NULL);
+
+	pthread_mutex_lock(&initLock);
+	s->next=slabList;
+	slabList=s;
+	s->gen=++slabGen;
+	for(id=0; id<SLAB_MAX_CACHES && s->id<0; id++)
+	{
+		if(slabCaches[id]==NULL)
+		{
+			slabCaches[id]=s;
+			s->id=id;
+		}
+	}
+	pthread_mutex_unlock(&initLock);
+
 
+	return;
+}
 
 /**
- * Allocate memory block
- *
- * Allocates a block of size bytes of memory, returning a pointer to the
- * beginning of the block.  The content of the newly allocated block of
- * memory is not initialized, remaining with indeterminate values.
+ * Allocates one object from a slab cache.
  *
- * @param size
- *    Size of the memory block, in bytes.
+ * @param s
+ *    The cache to allocate from.
  *
  * @return
- *    On success, a pointer to the memory block allocated by the function.
- *
- *    The type of this pointer is always void*, which can be cast to the
- *    desired type of data pointer in order to be dereferenceable.
- *
- *    If the function failed to allocate the requested block of memory,
- *    a null pointer is returned.
- *
- * @see http://www.cplusplus.com/reference/clibrary/cstdlib/malloc/
+ *    A pointer to an uninitialized object, or NULL if no memory could be
+ *    mapped.
  */
-void *malloc(size_t size)
+void *slab_alloc(slab_t *s)
 {
-	if(memTable==NULL)
-	{
-		memTable->address=NULL;
-		memTable->free=0;
-		memTable->left=NULL;
-		memTable->right=NULL;
-		memTable->size=0;
-	}
-	MemoryBlock *itr=memTable;		//iterator
-	int done=0;
-	void* addr=NULL;
+	void *obj=NULL;
+	SlabMagazine *mag=slabMagazine(s);
 
 
-	while(done==0)
+	if(mag!=NULL && mag->count>0)
+	{
+		obj=mag->objs[--mag->count];
+	}
+	else
 	{
-		if(size<itr->size)
+		pthread_mutex_lock(&s->lock);
+		if(mag!=NULL)//refill half a magazine while the lock is held anyway
 		{
-			if(itr->free)//reuse if available
-				addr=itr->address;
-			else if(itr->left==NULL)
-				done=1;
-			else
-				itr=itr->left;
+			void *extra;
+			while(mag->count<SLAB_MAGAZINE/2 && (extra=slabTake(s))!=NULL)
+				mag->objs[mag->count++]=extra;
+			if(mag->count>0)
+				obj=mag->objs[--mag->count];
 		}
 		else
 		{
-			if(itr->right==NULL)
-				done=2;
-			else
-				itr=itr->right;
+			obj=slabTake(s);
 		}
+		pthread_mutex_unlock(&s->lock);
 	}
 
-	if(addr==NULL)
+
+	return obj;
+}
+
+/**
+ * Returns an object to the slab cache it was allocated from.
+ *
+ * @param s
+ *    The cache obj came from.
+ * @param obj
+ *    Object returned by slab_alloc() on the same cache. If NULL, no action
+ *    occurs.
+ */
+void slab_free(slab_t *s, void *obj)
+{
+	SlabMagazine *mag=slabMagazine(s);
+
+
+	if(obj!=NULL && mag!=NULL && mag->count<SLAB_MAGAZINE)
+	{
+		mag->objs[mag->count++]=obj;
+	}
+	else if(obj!=NULL)
 	{
-		if(done==1)
+		pthread_mutex_lock(&s->lock);
+		if(mag!=NULL)//the magazine is full, hand half of it back
 		{
-			itr->left=sbrk(sizeof(MemoryBlock));
-
-			itr->left->address=sbrk(size);
-			itr->left->free=1;
-			itr->left->left=NULL;
-			itr->left->right=NULL;
-			itr->left->size=size;
+			while(mag->count>SLAB_MAGAZINE/2)
+			{
+				void *extra=mag->objs[--mag->count];
+				*(void**)extra=s->freeList;
+				s->freeList=extra;
+			}
+			mag->objs[mag->count++]=obj;
 		}
 		else
 		{
-			itr->right=sbrk(sizeof(MemoryBlock));
-
-			itr->right->address=sbrk(size);
-			itr->right->free=1;
-			itr->right->left=NULL;
-			itr->right->right=NULL;
-			itr->right->size=size;
+			*(void**)obj=s->freeList;
+			s->freeList=obj;
 		}
+		pthread_mutex_unlock(&s->lock);
 	}
 
 
-	return addr;
+	return;
 }
 
-
 /**
- * Deallocate space in memory
- *
- * A block of memory previously allocated using a call to malloc(),
- * calloc() or realloc() is deallocated, making it available again for
- * further allocations.
+ * Unmaps every chunk of a slab cache.
  *
- * Notice that this function leaves the value of ptr unchanged, hence
- * it still points to the same (now invalid) location, and not to the
- * null pointer.
+ * All objects of the cache become invalid, including those still sitting in
+ * other threads' magazines.
  *
- * @param ptr
- *    Pointer to a memory block previously allocated with malloc(),
- *    calloc() or realloc() to be deallocated.  If a null pointer is
- *    passed as argument, no action occurs.
+ * @param s
+ *    The cache to destroy.
  */
-void free(void *ptr)
+void slab_destroy(slab_t *s)
 {
-	// "If a null pointer is passed as argument, no action occurs."
-	if (ptr!=NULL)//changed from original "if" because mult. returns is bad
+	slab_t **link;
+
+
+	pthread_mutex_lock(&initLock);
+	if(s->id>=0)
+		slabCaches[s->id]=NULL;
+	for(link=&slabList; *link!=NULL && *link!=s; link=&(*link)->next)
+		;
+	if(*link!=NULL)
+		*link=s->next;
+	pthread_mutex_unlock(&initLock);
+
+
+	while(s->chunks!=NULL)
 	{
-		free(ptr, memTable);
+		void *chunk=s->chunks;
+		s->chunks=*(void**)chunk;
+		osUnmap(chunk, s->chunkSize, &statMapped);
 	}
+	s->freeList=NULL;
+	pthread_mutex_destroy(&s->lock);
+
 
 	return;
 }
 
-int free(void *ptr, MemoryBlock* curr)
+
+/*
+ * Makes the region bump out of a chunk with room for size bytes: the next
+ * chunk in the chain if a reset left one big enough, otherwise a new mapping
+ * linked in right after the current chunk.
+ */
+static int regionNext(region_t *r, size_t size)
 {
-	int done=0;
+	int ok=0;
+	RegionChunk *chunk=r->current!=NULL ? r->current->next : r->first;
+	size_t need=sizeof(RegionChunk)+size;
 
-	if(curr!=NULL)
+
+	if(chunk!=NULL && chunk->size>=need)
 	{
-		if(ptr==curr->address)
-		{
-			curr->free=1;
-			done=1;
-		}
-		else
+		ok=1;
+	}
+	else if(need>size)
+	{
+		size_t length=pageRound(need<REGION_CHUNK ? REGION_CHUNK : need);
+		void *map=length!=0 ? osMap(length, 0, &statMapped) : MAP_FAILED;
+
+		if(map!=MAP_FAILED)
 		{
-			if(!free(curr->left))
-				free(curr->right);
+			chunk=map;
+			chunk->size=length;
+			chunk->next=r->current!=NULL ? r->current->next : r->first;
+			if(r->current!=NULL)
+				r->current->next=chunk;
+			else
+				r->first=chunk;
+			ok=1;
 		}
 	}
 
+	if(ok)
+	{
+		r->current=chunk;
+		r->top=(char*)(chunk+1);
+		r->end=(char*)chunk+chunk->size;
+	}
+
 
-	return done;
+	return ok;
 }
 
 
 /**
- * Reallocate memory block
- *
- * The size of the memory block pointed to by the ptr parameter is changed
- * to the size bytes, expanding or reducing the amount of memory available
- * in the block.
- *
- * The function may move the memory block to a new location, in which case
- * the new location is returned. The content of the memory block is preserved
- * up to the lesser of the new and old sizes, even if the block is moved. If
- * the new size is larger, the value of the newly allocated portion is
- * indeterminate.
+ * Initializes an empty region. No memory is mapped until the first
+ * region_alloc().
  *
- * In case that ptr is NULL, the function behaves exactly as malloc, assigning
- * a new block of size bytes and returning a pointer to the beginning of it.
- *
- * In case that the size is 0, the memory previously allocated in ptr is
- * deallocated as if a call to free was made, and a NULL pointer is returned.
- *
- * @param ptr
- *    Pointer to a memory block previously allocated with malloc(), calloc()
- *    or realloc() to be reallocated.
+ * @param r
+ *    The region to initialize.
+ */
+void region_init(region_t *r)
+{
+	if(!initialized)
+		allocInit();
+
+	r->first=NULL;
+	r->current=NULL;
+	r->top=NULL;
+	r->end=NULL;
+
+
+	return;
+}
+
+/**
+ * Allocates size bytes from a region, 16-byte aligned.
  *
- *    If this is NULL, a new block is allocated and a pointer to it is
- *    returned by the function.
+ * The memory stays valid until the next region_reset() or region_destroy()
+ * and must not be passed to free().
  *
+ * @param r
+ *    The region to allocate from.
  * @param size
- *    New size for the memory block, in bytes.
- *
- *    If it is 0 and ptr points to an existing block of memory, the memory
- *    block pointed by ptr is deallocated and a NULL pointer is returned.
+ *    Number of bytes wanted.
  *
  * @return
- *    A pointer to the reallocated memory block, which may be either the
- *    same as the ptr argument or a new location.
+ *    A pointer to the memory, or NULL if no more memory could be mapped.
+ */
+void *region_alloc(region_t *r, size_t size)
+{
+	void *addr=NULL;
+	size_t rounded=(size+ALIGNMENT-1)&~(size_t)(ALIGNMENT-1);
+
+
+	if(rounded>=size)
+	{
+		if((size_t)(r->end-r->top)>=rounded || regionNext(r, rounded))
+		{
+			addr=r->top;
+			r->top+=rounded;
+		}
+	}
+
+
+	return addr;
+}
+
+/**
+ * Releases everything allocated from a region in O(1).
  *
- *    The type of this pointer is void*, which can be cast to the desired
- *    type of data pointer in order to be dereferenceable.
+ * The chunks stay mapped and are bumped through again by later allocations.
  *
- *    If the function failed to allocate the requested block of memory,
- *    a NULL pointer is returned, and the memory block pointed to by
- *    argument ptr is left unchanged.
+ * @param r
+ *    The region to reset.
+ */
+void region_reset(region_t *r)
+{
+	r->current=NULL;
+	r->top=NULL;
+	r->end=NULL;
+	if(r->first!=NULL)
+	{
+		r->current=r->first;
+		r->top=(char*)(r->first+1);
+		r->end=(char*)r->first+r->first->size;
+	}
+
+
+	return;
+}
+
+/**
+ * Unmaps every chunk of a region. All memory allocated from it becomes
+ * invalid.
  *
- * @see http://www.cplusplus.com/reference/clibrary/cstdlib/realloc/
+ * @param r
+ *    The region to destroy.
  */
-void *realloc(void *ptr, size_t size)
+void region_destroy(region_t *r)
 {
-	void *addr=NULL;
+	while(r->first!=NULL)
+	{
+		RegionChunk *chunk=r->first;
+		r->first=chunk->next;
+		osUnmap(chunk, chunk->size, &statMapped);
+	}
+	region_init(r);
 
-	// "In case that ptr is NULL, the function behaves exactly as malloc()"
-	if (ptr==NULL)
+
+	return;
+}
+
+
+/**
+ * Reads the resident and the huge-page-backed bytes of the whole process.
+ *
+ * Kept out of alloc_stats() because it is not cheap: the kernel walks every
+ * mapping of the process to produce /proc/self/smaps_rollup. Uses plain
+ * read(), so it never allocates.
+ *
+ * @param rss
+ *    Set to the resident bytes, 0 if the file is missing.
+ * @param huge
+ *    Set to the part of them backed by transparent huge pages, 0 if the
+ *    file is missing.
+ */
+void alloc_rss(size_t *rss, size_t *huge)
+{
+	char buf[4096];
+	int fd=open("/proc/self/smaps_rollup", O_RDONLY|O_CLOEXEC);
+	ssize_t len=fd>=0 ? read(fd, buf, sizeof(buf)-1) : -1;
+	char *field;
+
+
+	*rss=0;
+	*huge=0;
+	if(len>0)
 	{
-		addr=malloc(size);
+		buf[len]='\0';
+		if((field=strstr(buf, "\nRss:"))!=NULL)
+			*rss=strtoul(field+5, NULL, 10)*1024;
+		if((field=strstr(buf, "\nAnonHugePages:"))!=NULL)
+			*huge=strtoul(field+15, NULL, 10)*1024;
 	}
-	// "In case that the size is 0, the memory previously allocated in ptr
-	//  is deallocated as if a call to free() was made, and a NULL pointer
-	//  is returned."
-	else if (size==0)
+	if(fd>=0)
+		close(fd);
+
+
+	return;
+}
+
+
+/**
+ * Takes a snapshot of the allocator's footprint and counters.
+ *
+ * Cheap enough to call at runtime: it sums a few counters per arena and per
+ * live thread without stopping anybody, so the numbers are approximate while
+ * other threads allocate.
+ *
+ * @param stats
+ *    Filled in with the current values.
+ */
+void alloc_stats(alloc_stats_t *stats)
+{
+	int i, cls;
+	ThreadCache *itr;
+
+
+	memset(stats, 0, sizeof(alloc_stats_t));
+	stats->heapBytes=__atomic_load_n(&statHeap, __ATOMIC_RELAXED);
+	stats->mappedBytes=__atomic_load_n(&statMapped, __ATOMIC_RELAXED);
+	stats->peakBytes=__atomic_load_n(&statPeak, __ATOMIC_RELAXED);
+	stats->sbrkCalls=__atomic_load_n(&statSbrk, __ATOMIC_RELAXED);
+	stats->mmapCalls=__atomic_load_n(&statMmap, __ATOMIC_RELAXED);
+	stats->munmapCalls=__atomic_load_n(&statMunmap, __ATOMIC_RELAXED);
+	stats->mremapCalls=__atomic_load_n(&statMremap, __ATOMIC_RELAXED);
+
+	for(i=0; i<arenaCount; i++)
+		stats->freeBytes+=arenas[i].freeBytes;
+
+	for(cls=0; cls<ALLOC_SIZE_CLASSES; cls++)
 	{
-		free(ptr);
+		stats->classSize[cls]=cls<NUM_BINS ? binSize(cls) : mmapThreshold;
+		stats->allocs[cls]=retiredAllocs[cls];
 	}
-	else
+
+	pthread_mutex_lock(&initLock);
+	for(itr=caches; itr!=NULL; itr=itr->nextCache)
 	{
-		addr=realloc(ptr, size, memTable);
+		for(cls=0; cls<SMALL_BINS; cls++)
+			stats->cachedBytes+=(size_t)itr->counts[cls]*binSize(cls);
+		for(cls=0; cls<ALLOC_SIZE_CLASSES; cls++)
+			stats->allocs[cls]+=itr->allocs[cls];
 	}
+	pthread_mutex_unlock(&initLock);
 
+	if(stats->heapBytes>=stats->freeBytes+stats->cachedBytes)
+		stats->inUseBytes=stats->heapBytes-stats->freeBytes-stats->cachedBytes;
+	stats->inUseBytes+=stats->mappedBytes;
+	if(stats->heapBytes!=0)
+		stats->fragmentation=(double)stats->freeBytes/(double)stats->heapBytes;
+	stats->hugePages=hugePages;
 
-	return addr;
+
+	return;
 }
 
-void* realloc(void *ptr, size_t size, MemoryBlock* curr)
+/**
+ * Prints alloc_stats() and alloc_rss() to stderr, one size class per line for
+ * the classes that saw any allocations. Runs at exit when ALLOC_STATS is set.
+ *
+ * Formats into a stack buffer and write()s it, so it never allocates.
+ */
+void malloc_stats()
 {
-	void *addr=NULL;
+	alloc_stats_t stats;
+	size_t rss, huge;
+	char line[512];
+	int cls, len;
 
-	if(curr!=NULL)
-	{
-		if(ptr==curr->address)
-		{
-			if(curr->size>=size)
-			{
-				addr=ptr;
-			}
-			else
-			{
-				addr=malloc(size);
-				memcpy(addr, curr, curr->size);
-				free(ptr);
-			}
 
-		}
-		else
+	alloc_stats(&stats);
+	alloc_rss(&rss, &huge);
+	len=snprintf(line, sizeof(line),
+			"heap %zu  mapped %zu  in use %zu  free %zu  cached %zu  peak %zu\n"
+			"fragmentation %.3f  sbrk %lu  mmap %lu  munmap %lu  mremap %lu\n"
+			"rss %zu  huge pages %zu  huge page mode %s\n",
+			stats.heapBytes, stats.mappedBytes, stats.inUseBytes, stats.freeBytes,
+			stats.cachedBytes, stats.peakBytes, stats.fragmentation, stats.sbrkCalls,
+			stats.mmapCalls, stats.munmapCalls, stats.mremapCalls, rss, huge,
+			stats.hugePages ? "on" : "off");
+	if(write(STDERR_FILENO, line, len)<0)
+		len=0;
+
+	for(cls=0; cls<ALLOC_SIZE_CLASSES; cls++)
+	{
+		if(stats.allocs[cls]!=0)
 		{
-			if(free(curr->left)==NULL)
-				free(curr->right);
+			len=snprintf(line, sizeof(line), "%s%10zu %12lu\n",
+					cls==MMAP_CLASS ? "mmap>=" : "class ", stats.classSize[cls], stats.allocs[cls]);
+			if(write(STDERR_FILENO, line, len)<0)
+				len=0;
 		}
 	}
 
 
-	return addr;
+	return;
 }
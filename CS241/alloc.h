@@ -0,0 +1,131 @@
+/** @file alloc.h */
+
+#ifndef ALLOC_H_
+#define ALLOC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+
+/**
+ * Number of size classes in alloc_stats_t: 64 exact classes of 16 bytes up
+ * to 1 KiB, four per power of two above that, and a last one for blocks that
+ * got their own mapping.
+ */
+#define ALLOC_SIZE_CLASSES (64+4*54+1)
+
+/**
+ * Snapshot of the allocator's footprint, filled in by alloc_stats(). Bytes
+ * include block headers. Values are read without stopping other threads, so
+ * they are approximate while those threads allocate.
+ */
+typedef struct _alloc_stats_t
+{
+	size_t heapBytes;		//sbrk heap plus secondary arena heaps
+	size_t mappedBytes;		//large blocks, slab chunks and regions with their own mappings
+	size_t freeBytes;		//free blocks in the arenas' bins
+	size_t cachedBytes;		//free blocks parked in thread caches
+	size_t inUseBytes;		//everything else, i.e. what the program holds
+	size_t peakBytes;		//highest heapBytes+mappedBytes so far
+	double fragmentation;	//freeBytes/heapBytes, 0 for an empty heap
+	int hugePages;			//huge page mode (ALLOC_HUGEPAGES) is in effect
+
+	unsigned long sbrkCalls;
+	unsigned long mmapCalls;
+	unsigned long munmapCalls;
+	unsigned long mremapCalls;
+
+	unsigned long allocs[ALLOC_SIZE_CLASSES];	//allocations made per size class
+	size_t classSize[ALLOC_SIZE_CLASSES];		//smallest block size of each class
+} alloc_stats_t;
+
+
+/**
+ * Allocation trace format. Setting ALLOC_TRACE=prefix makes every process
+ * write its malloc/free/realloc calls to prefix.<pid>: one alloc_trace_header_t
+ * followed by alloc_trace_t records. Threads buffer their records and write
+ * them in batches, so the file is ordered by batch; seq gives the real order.
+ */
+#define ALLOC_TRACE_MAGIC 0x43525441u	//"ATRC" when read little-endian
+#define ALLOC_TRACE_VERSION 1
+
+enum
+{
+	TRACE_MALLOC=1,		//ptr=malloc(size)
+	TRACE_CALLOC,		//ptr=calloc(aux, size)
+	TRACE_REALLOC,		//ptr=realloc(aux, size)
+	TRACE_FREE,			//free(ptr)
+	TRACE_MEMALIGN		//ptr=memalign(aux, size), for the whole aligned family
+};
+
+typedef struct _alloc_trace_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t recordSize;	//sizeof(alloc_trace_t) of the writer
+	uint32_t pid;
+} alloc_trace_header_t;
+
+typedef struct _alloc_trace_t
+{
+	uint64_t seq;			//global order of the calls in one process
+	uint64_t ptr;			//address returned, or freed
+	uint64_t aux;			//old address, alignment or element count
+	uint64_t size;			//bytes asked for, per element for calloc
+	uint32_t thread;		//small per-process thread number, from 1
+	uint32_t op;			//one of TRACE_*
+} alloc_trace_t;
+
+
+/**
+ * Object cache for many same-sized objects (Bonwick-style slab allocator).
+ *
+ * Objects are cut from page-sized chunks that are mapped directly, so they
+ * never touch the general-purpose heap. Each thread keeps a small magazine of
+ * free objects per cache and only takes the cache's lock to refill or flush
+ * it in batches. Caches stay usable in the child after fork().
+ */
+typedef struct _slab_t
+{
+	size_t objSize;			//object size rounded up to the alignment
+	size_t chunkSize;		//bytes mapped per chunk
+	void *freeList;			//free objects, linked through their first word
+	void *chunks;			//every chunk, linked through its first word
+	int id;					//slot for per-thread magazines, -1 if none
+	unsigned int gen;		//tells a magazine whether it belongs to this cache
+	pthread_mutex_t lock;
+	struct _slab_t *next;	//next live cache, the fork handlers lock them all
+} slab_t;
+
+
+/**
+ * Bump-pointer region for memory that dies all at once (one request, one
+ * batch). Allocation is a pointer increment inside mapped chunks; nothing is
+ * freed individually, region_reset() rewinds to the first chunk and keeps the
+ * chunks for the next round. Not thread-safe, use one region per thread.
+ */
+typedef struct _region_t
+{
+	struct _RegionChunk *first;
+	struct _RegionChunk *current;
+	char *top;				//next free byte in current
+	char *end;				//end of current
+} region_t;
+
+
+void   slab_init   (slab_t *s, size_t size);
+void * slab_alloc  (slab_t *s);
+void   slab_free   (slab_t *s, void *obj);
+void   slab_destroy(slab_t *s);
+
+void   region_init   (region_t *r);
+void * region_alloc  (region_t *r, size_t size);
+void   region_reset  (region_t *r);
+void   region_destroy(region_t *r);
+
+void   alloc_stats   (alloc_stats_t *stats);
+void   alloc_rss     (size_t *rss, size_t *huge);
+void   malloc_stats  ();
+
+#endif /* ALLOC_H_ */
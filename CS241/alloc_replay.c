@@ -0,0 +1,308 @@
+/** @file alloc_replay.c */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "alloc.h"
+
+
+/*
+ * Replays an allocation trace written by alloc.c (run the program with
+ * ALLOC_TRACE=prefix) against the allocator this is linked with, and reports
+ * throughput, per-call latency percentiles and peak RSS. Link it with alloc.c
+ * to measure that, or leave alloc.c out to measure the system malloc:
+ *
+ *     gcc -O2 -pthread -o alloc_replay alloc_replay.c alloc.c
+ *     alloc_replay [-w] trace.<pid>
+ *
+ * -w writes every byte that is handed out, so RSS reflects the full sizes.
+ *
+ * All calls are replayed in sequence order on a single thread. Addresses in
+ * the trace are only used to pair a block with its free or realloc.
+ */
+
+
+//one call to replay, with the trace's addresses resolved to slots
+typedef struct _Op
+{
+	uint32_t op;
+	long slot;		//where the result goes, -1 for free
+	long old;		//slot freed or reallocated, -1 if none
+	uint64_t aux;
+	uint64_t size;
+} Op;
+
+
+//Prototypes
+int seqCmp(const void *x, const void *y);
+int latCmp(const void *x, const void *y);
+long resolve(const alloc_trace_t *recs, long count, Op *ops);
+long rssKiB(const char *field);
+
+
+/**
+ * Entry point to alloc_replay.
+ */
+int main(int argc, char **argv)
+{
+	int touch=0;
+	int temp;
+	int fd;
+	struct stat st;
+	alloc_trace_header_t *header;
+	alloc_trace_t *recs;
+	long count, i;
+	long reordered;
+	long perOp[TRACE_MEMALIGN+1]={0};
+	Op *ops;
+	void **slots;
+	uint64_t *lat;
+	long rssBefore;
+	struct timespec start, end, t0, t1;
+	double seconds;
+
+
+	while((temp=getopt(argc, argv, "w"))!=-1)
+	{
+		if(temp=='w')
+			touch=1;
+		else
+			return 1;
+	}
+	if(optind>=argc)
+	{
+		fprintf(stderr, "usage: %s [-w] tracefile\n", argv[0]);
+		return 1;
+	}
+
+	fd=open(argv[optind], O_RDONLY);
+	if(fd<0 || fstat(fd, &st)<0 || (size_t)st.st_size<sizeof(alloc_trace_header_t))
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	header=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(header==MAP_FAILED || header->magic!=ALLOC_TRACE_MAGIC
+			|| header->version!=ALLOC_TRACE_VERSION || header->recordSize!=sizeof(alloc_trace_t))
+	{
+		fprintf(stderr, "%s: not a version %d allocation trace\n", argv[optind], ALLOC_TRACE_VERSION);
+		return 1;
+	}
+	count=(st.st_size-sizeof(alloc_trace_header_t))/sizeof(alloc_trace_t);
+
+
+	//threads write their records in batches, put them back in call order
+	recs=malloc(count*sizeof(alloc_trace_t));
+	ops=malloc(count*sizeof(Op));
+	slots=calloc(count, sizeof(void*));
+	lat=malloc(count*sizeof(uint64_t));
+	if(count>0 && (recs==NULL || ops==NULL || slots==NULL || lat==NULL))
+	{
+		fprintf(stderr, "not enough memory for %ld records\n", count);
+		return 1;
+	}
+	memcpy(recs, header+1, count*sizeof(alloc_trace_t));
+	munmap(header, st.st_size);
+	close(fd);
+	qsort(recs, count, sizeof(alloc_trace_t), seqCmp);
+	reordered=resolve(recs, count, ops);
+	free(recs);
+
+
+	//restart the high-water mark so loading the trace does not count
+	rssBefore=rssKiB("VmRSS:");
+	fd=open("/proc/self/clear_refs", O_WRONLY);
+	if(fd>=0)
+	{
+		if(write(fd, "5", 1)<0)
+			fprintf(stderr, "peak RSS includes loading the trace\n");
+		close(fd);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i=0; i<count; i++)
+	{
+		Op *op=&ops[i];
+		void *old=op->old>=0 ? slots[op->old] : NULL;
+		void *addr=NULL;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if(op->op==TRACE_MALLOC)
+			addr=malloc(op->size);
+		else if(op->op==TRACE_CALLOC)
+			addr=calloc(op->aux, op->size);
+		else if(op->op==TRACE_REALLOC)
+			addr=realloc(old, op->size);
+		else if(op->op==TRACE_FREE)
+			free(old);
+		else if(op->op==TRACE_MEMALIGN && posix_memalign(&addr, op->aux, op->size)!=0)
+			addr=NULL;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		lat[i]=(uint64_t)(t1.tv_sec-t0.tv_sec)*1000000000ULL+t1.tv_nsec-t0.tv_nsec;
+		if(op->old>=0)
+			slots[op->old]=NULL;
+		if(op->slot>=0)
+			slots[op->slot]=addr;
+		if(touch && addr!=NULL && op->op!=TRACE_FREE)
+			memset(addr, 0xa5, op->op==TRACE_CALLOC ? op->aux*op->size : op->size);
+		perOp[op->op]++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+
+	seconds=(end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+	qsort(lat, count, sizeof(uint64_t), latCmp);
+	printf("calls      %ld (malloc %ld, calloc %ld, realloc %ld, free %ld, memalign %ld)\n",
+			count, perOp[TRACE_MALLOC], perOp[TRACE_CALLOC], perOp[TRACE_REALLOC],
+			perOp[TRACE_FREE], perOp[TRACE_MEMALIGN]);
+	if(reordered>0)
+		printf("reordered  %ld addresses were handed out again before their free was recorded\n", reordered);
+	printf("time       %.6f s, %.0f calls/s\n", seconds, seconds>0 ? count/seconds : 0.0);
+	if(count>0)
+	{
+		printf("latency ns p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+				(unsigned long long)lat[count*50/100], (unsigned long long)lat[count*90/100],
+				(unsigned long long)lat[count*99/100], (unsigned long long)lat[count*999/1000],
+				(unsigned long long)lat[count-1]);
+	}
+	printf("peak RSS   %ld KiB (%ld KiB before the replay)\n", rssKiB("VmHWM:"), rssBefore);
+
+	for(i=0; i<count; i++)
+		free(slots[i]);
+	free(slots);
+	free(ops);
+	free(lat);
+
+
+	return 0;
+}
+
+
+//orders trace records by sequence number
+int seqCmp(const void *x, const void *y)
+{
+	uint64_t a=((const alloc_trace_t*)x)->seq;
+	uint64_t b=((const alloc_trace_t*)y)->seq;
+
+
+	return a<b ? -1 : a>b;
+}
+
+//orders latencies, smallest first
+int latCmp(const void *x, const void *y)
+{
+	uint64_t a=*(const uint64_t*)x;
+	uint64_t b=*(const uint64_t*)y;
+
+
+	return a<b ? -1 : a>b;
+}
+
+/*
+ * Turns the recorded addresses into slot numbers. Every call that hands out
+ * memory gets its own slot (its index), and frees and reallocs look up the
+ * slot of the live block at their address in a chained hash table. Returns
+ * how many addresses showed up again while still live, which happens when a
+ * realloc moved a block and another thread got the old address before the
+ * realloc was recorded; the older block is then left alone for the rest of
+ * the replay.
+ */
+long resolve(const alloc_trace_t *recs, long count, Op *ops)
+{
+	long buckets=1;
+	long *heads;
+	long *next;
+	long i;
+	long reordered=0;
+
+
+	while(buckets<count)
+		buckets<<=1;
+	heads=malloc(buckets*sizeof(long));
+	next=malloc((count>0 ? count : 1)*sizeof(long));
+	for(i=0; i<buckets; i++)
+		heads[i]=-1;
+
+	for(i=0; i<count; i++)
+	{
+		const alloc_trace_t *rec=&recs[i];
+		int hands=rec->op!=TRACE_FREE;
+		uint64_t key=0;
+		long *link;
+
+		if(rec->op==TRACE_FREE)
+			key=rec->ptr;
+		else if(rec->op==TRACE_REALLOC)
+			key=rec->aux;
+
+		ops[i].op=rec->op;
+		ops[i].aux=rec->aux;
+		ops[i].size=rec->size;
+		ops[i].slot=hands ? i : -1;
+		ops[i].old=-1;
+
+		//unlink the block being freed or reallocated
+		if(key!=0)
+		{
+			for(link=&heads[(key>>4)&(buckets-1)]; *link>=0; link=&next[*link])
+			{
+				if(recs[*link].ptr==key)
+				{
+					ops[i].old=*link;
+					*link=next[*link];
+					break;
+				}
+			}
+		}
+
+		//and link the new one, dropping a stale entry at the same address
+		if(hands && rec->ptr!=0)
+		{
+			for(link=&heads[(rec->ptr>>4)&(buckets-1)]; *link>=0; link=&next[*link])
+			{
+				if(recs[*link].ptr==rec->ptr)
+				{
+					*link=next[*link];
+					reordered++;
+					break;
+				}
+			}
+			link=&heads[(rec->ptr>>4)&(buckets-1)];
+			next[i]=*link;
+			*link=i;
+		}
+	}
+
+	free(heads);
+	free(next);
+
+
+	return reordered;
+}
+
+//reads one of the KiB values (VmRSS, VmHWM) from /proc/self/status
+long rssKiB(const char *field)
+{
+	long kib=-1;
+	char line[256];
+	FILE *status=fopen("/proc/self/status", "r");
+
+
+	while(status!=NULL && kib<0 && fgets(line, sizeof(line), status)!=NULL)
+	{
+		if(strncmp(line, field, strlen(field))==0)
+			kib=strtol(line+strlen(field), NULL, 10);
+	}
+	if(status!=NULL)
+		fclose(status);
+
+
+	return kib;
+}
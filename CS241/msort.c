@@ -3,19 +3,184 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
 #include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
-//Prototypes
-void* merge(void *args);
-void* sortSeg(void *args);
-int intCmp(const void *x, const void *y);
-int parse(char *x);
+//Constants
+#define READ_BLOCK (64*1024*1024)	//bytes of piped input parsed per round
+#define MIN_PARSE_SPAN (1024*1024)	//smallest piece of text worth a thread of its own
+#define MAX_THREADS 256
+#define DEQUE_SIZE 1024				//pending tasks per worker, more run inline
+#define MIN_MERGE_SPAN (64*1024)		//smallest share of a merge worth a task of its own
+#define RADIX_BITS 8					//bits sorted per radix pass
+#define RADIX_BUCKETS (1<<RADIX_BITS)
+#define RADIX_LINE 64					//bytes buffered per bucket before a scatter write
+#define MIN_RADIX_SPAN (64*1024)		//smallest block of keys worth a radix task of its own
+#define NET_BLOCK 64					//ints handed to one sorting network call
+#define NET_CHUNK 4096				//ints sorted in cache before chunks are merged
+#define MIN_NATURAL_RUN 1024			//average run length the input needs to be merged as it is
+#define RUN_SLACK 16					//runs a scan allows itself before judging the average
+#define MIN_BUDGET (1024*1024)			//smallest memory budget for an external sort
+#define MIN_RUN_BUFFER (64*1024)		//bytes, smallest read from a run when merging
+#define LEAF_KEY(v, i) ((uint64_t)((uint32_t)(v)^0x80000000u)<<32 | (uint32_t)(i))	//loser tree key, ties go to leaf i first
 
+//radix keys: order preserving maps from signed values to unsigned ones
+#define INT32_KEY(x) ((uint32_t)(x)^0x80000000u)
+#define INT64_KEY(x) ((uint64_t)(x)^0x8000000000000000ull)
+#define UINT64_KEY(x) ((uint64_t)(x))
+#define DOUBLE_KEY(x) doubleKey(x)
+#define PAIR_KEY(x) ((x).key)
+#define MAX_TOKEN 64					//longest number token the typed parser reads
+#define WRITE_BLOCK (1024*1024)		//bytes of binary output the external merge collects per write
+
+//key types for -t
+#define KEY_INT32 0
+#define KEY_INT64 1
+#define KEY_UINT64 2
+#define KEY_DOUBLE 3
 
-//Globals (ugh)
-int *values;
-int size;
+
+/*
+ * Instantiates name(a, tmp, n), a parallel LSD radix sort of the n values of
+ * type in a, with tmp as scratch space of the same size. ukey() maps a value
+ * to an unsigned key of the same width that sorts the same way.
+ *
+ * Every pass sorts on the next RADIX_BITS bits. Each worker counts the digits
+ * in its own block of the input, the counts become a starting offset per
+ * worker and bucket, and each worker scatters its block through a cache line
+ * sized buffer per bucket so the writes leave a full line at a time. A pass
+ * in which every key has the same digit moves nothing and is skipped.
+ * Returns a or tmp, whichever the last pass left the sorted values in.
+ */
+#define RADIX_SORT(name, type, ukey) \
+typedef struct \
+{ \
+	const type *src; \
+	type *dst; \
+	size_t first, end; \
+	int shift; \
+	size_t count[RADIX_BUCKETS];	/* digit counts, then where each bucket goes next */ \
+} name##Part; \
+\
+void* name##Count(void *args) \
+{ \
+	name##Part *part=(name##Part*)args; \
+	size_t i; \
+\
+	memset(part->count, 0, sizeof(part->count)); \
+	for(i=part->first; i<part->end; i++) \
+		part->count[(ukey(part->src[i])>>part->shift)&(RADIX_BUCKETS-1)]++; \
+\
+	return NULL; \
+} \
+\
+void* name##Scatter(void *args) \
+{ \
+	name##Part *part=(name##Part*)args; \
+	type line[RADIX_BUCKETS][RADIX_LINE/sizeof(type)] __attribute__((aligned(RADIX_LINE))); \
+	unsigned char fill[RADIX_BUCKETS]; \
+	size_t *next=part->count; \
+	size_t i; \
+	int b; \
+\
+	memset(fill, 0, sizeof(fill)); \
+	for(i=part->first; i<part->end; i++) \
+	{ \
+		type v=part->src[i]; \
+\
+		b=(ukey(v)>>part->shift)&(RADIX_BUCKETS-1); \
+		line[b][fill[b]++]=v; \
+		if(fill[b]==RADIX_LINE/sizeof(type)) \
+		{ \
+			memcpy(&part->dst[next[b]], line[b], RADIX_LINE); \
+			next[b]+=RADIX_LINE/sizeof(type); \
+			fill[b]=0; \
+		} \
+	} \
+	for(b=0; b<RADIX_BUCKETS; b++) \
+		memcpy(&part->dst[next[b]], line[b], fill[b]*sizeof(type)); \
+\
+	return NULL; \
+} \
+\
+type* name(type *a, type *tmp, size_t n) \
+{ \
+	int parts=(int)(n/MIN_RADIX_SPAN); \
+	name##Part *part; \
+	Task tasks[MAX_THREADS]; \
+	int shift, p, b; \
+\
+	if(parts>threads) \
+		parts=threads; \
+	if(parts<1) \
+		parts=1; \
+	part=malloc(parts*sizeof(name##Part)); \
+	for(p=0; p<parts; p++) \
+	{ \
+		part[p].first=n*p/parts; \
+		part[p].end=n*(p+1)/parts; \
+	} \
+\
+	for(shift=0; shift<(int)(8*sizeof(type)); shift+=RADIX_BITS) \
+	{ \
+		size_t start=0; \
+		int skip=0; \
+\
+		for(p=0; p<parts; p++) \
+		{ \
+			part[p].src=a; \
+			part[p].dst=tmp; \
+			part[p].shift=shift; \
+			if(p>0) \
+				spawn(&tasks[p], name##Count, &part[p]); \
+		} \
+		name##Count(&part[0]); \
+		for(p=parts-1; p>0; p--) \
+			join(&tasks[p]); \
+\
+		/* bucket b of worker p starts after all smaller buckets and after */ \
+		/* bucket b of the workers before it, so equal digits keep their order */ \
+		for(b=0; b<RADIX_BUCKETS; b++) \
+		{ \
+			size_t total=0; \
+\
+			for(p=0; p<parts; p++) \
+			{ \
+				size_t c=part[p].count[b]; \
+\
+				part[p].count[b]=start+total; \
+				total+=c; \
+			} \
+			if(total==n) \
+				skip=1; \
+			start+=total; \
+		} \
+		if(skip) \
+			continue; \
+\
+		for(p=1; p<parts; p++) \
+			spawn(&tasks[p], name##Scatter, &part[p]); \
+		name##Scatter(&part[0]); \
+		for(p=parts-1; p>0; p--) \
+			join(&tasks[p]); \
+		part[0].dst=a; \
+		a=tmp; \
+		tmp=part[0].dst; \
+	} \
+	free(part); \
+\
+	return a; \
+}
 
 
 /**
@@ -24,16 +189,243 @@ int size;
 typedef struct _Range
 {
 	int start, start2, end, numValues;
+	int *src, *dst;	//values or scratch: where the runs are and where the result goes
 } Range;
 
 
 /**
- * Dummy return type for pthread function, don't know if needed.
+ * A unit of fork/join work. The task lives on the stack of whoever spawned
+ * it, which must join() on it before returning.
+ */
+typedef struct _Task
+{
+	void* (*run)(void *args);
+	void *args;
+	int done;
+} Task;
+
+
+/**
+ * A pool thread and its deque of spawned tasks. The owner pushes and pops at
+ * the bottom, idle workers steal the oldest (biggest) task from the top.
+ */
+typedef struct _Worker
+{
+	pthread_mutex_t lock;
+	Task *deque[DEQUE_SIZE];
+	unsigned int top, bottom;
+	unsigned int seed;		//picks the next victim to steal from
+	pthread_t tid;
+} Worker;
+
+
+/**
+ * One independent slice of a two-way merge: the stretch of output starting at
+ * out takes m values from a and n from b.
+ */
+typedef struct _MergePart
+{
+	const int *a, *b;
+	int m, n;
+	int *out;
+	int dupes;
+} MergePart;
+
+
+/**
+ * Output ranks first..last of the k-way merge, merged by one task.
+ */
+typedef struct _KwayPart
+{
+	long first, last;
+	int *out;
+	int dupes;
+} KwayPart;
+
+
+/**
+ * The natural runs one worker found in its chunk of values, descending runs
+ * already reversed.
  */
-typedef struct _Result
+typedef struct _RunScan
 {
+	int first, end;
+	int *starts;
+	int count, capacity;
+	int random;		//gave up, the runs are too short to be worth keeping
+} RunScan;
+
+
+/**
+ * A record's key, mapped to an unsigned key in the same order, and where the
+ * record was in the input. Records are sorted through these.
+ */
+typedef struct _KeyIndex
+{
+	uint64_t key;
+	uint64_t index;
+} KeyIndex;
+
+
+/**
+ * Records first..end-1 of a record sort, keyed or gathered by one task.
+ */
+typedef struct _RecordPart
+{
+	size_t first, end;
+	KeyIndex *pairs;
+	char *out;
+} RecordPart;
+
+
+/**
+ * A sorted run spilled to a temporary file by an external sort, read back
+ * through two buffers: the merge takes values from buf[cur] while a pool task
+ * reads the next stretch of the file into the other one.
+ */
+typedef struct _Run
+{
+	int fd;
+	int *buf[2];
+	size_t have[2];	//values in each buffer
+	int cur;
+	size_t pos;		//next value in buf[cur]
+	size_t bufValues;
+	size_t count;	//values in the run
+	Task fetch;
+	int fetching;
+} Run;
+
+
+/**
+ * Fork/join sort job over segments first..last of ranges.
+ */
+typedef struct _Job
+{
+	int first, last;
+	int *dst;		//values or scratch, whichever the sorted segments go to
+} Job;
+
+
+/**
+ * Piece of the input text parsed by one thread, and the values found in it:
+ * ints, or fields of the key type in typed mode.
+ */
+typedef struct _Parsed
+{
+	const char *start, *end;
+	void *values;
+	size_t count, capacity;
+} Parsed;
+
+
+//Prototypes
+void* merge(void *args);
+void* mergePart(void *args);
+int coRank(int k, const int *a, int m, const int *b, int n);
+void kwayMerge();
+void* kwayPart(void *args);
+void kwaySplit(long r, int *pos);
+int rankOf(const int *a, int n, long long v);
+void treeBuild(const uint64_t *key, int *tree, int k);
+void treeReplay(const uint64_t *key, int *tree, int k);
+void sortValues();
+int findRuns();
+void* scanRuns(void *args);
+void spillRun();
+int runFile();
+void runWrite(int fd, const void *data, size_t len);
+void runAdd(int fd, size_t count);
+void externalMerge();
+void mergeRuns(Run *group, int count, int fd);
+void flushBlock(int *block, size_t count, int fd);
+void* runFetch(void *args);
+int runNext(Run *run, int *v);
+int* radixSort32(int *a, int *tmp, size_t n);
+void netInit();
+int* netSort(int *a, int *tmp, int n);
+int* netPasses(int *src, int *dst, int n, int width);
+void netBlockScalar(int *a);
+void netMergeScalar(const int *a, int m, const int *b, int n, int *out);
+#if defined(__x86_64__) || defined(__i386__)
+void netBlockAvx2(int *a);
+void netMergeAvx2(const int *a, int m, const int *b, int n, int *out);
+#endif
+int64_t* radixSort64(int64_t *a, int64_t *tmp, size_t n);
+uint64_t* radixSortU64(uint64_t *a, uint64_t *tmp, size_t n);
+double* radixSortDouble(double *a, double *tmp, size_t n);
+KeyIndex* radixSortPairs(KeyIndex *a, KeyIndex *tmp, size_t n);
+uint64_t doubleKey(double d);
+void sortRecords();
+void* keyRecords(void *args);
+void* gatherRecords(void *args);
+void printRecords();
+int keyTypeOf(const char *name);
+void* sortSeg(void *args);
+void* sortJob(void *args);
+int parse(char *x);
+void readValues();
+int inToken(char c);
+void* growBuffer(void *buf, size_t *cap, size_t need, size_t width);
+Parsed* parsePieces(const char *text, size_t len, void* (*span)(void *args), int *count);
+void parseText(const char *text, size_t len);
+void* parseSpan(void *args);
+void parseFields(const char *text, size_t len);
+void* parseFieldSpan(void *args);
+void readBinary();
+void loadBinary(const char *data, size_t len);
+void toLittle(void *data, size_t len, size_t width);
+void writeBinary(void *data, size_t len);
+void outputOpen(size_t len);
+void outputWrite(const void *data, size_t len);
+void outputClose();
+void poolInit();
+void* workerLoop(void *args);
+void spawn(Task *task, void* (*run)(void *args), void *args);
+void join(Task *task);
+Task* findTask();
+
 
-} Result;
+//Globals (ugh)
+int *values;
+int size;
+size_t capacity;	//ints values has room for
+int threads;		//online CPUs, workers in the pool
+Range *ranges;		//the segments, sorted one per leaf job
+int *scratch;		//as big as values, merge rounds go back and forth between the two
+int natural;		//the segments are natural runs of the input, already sorted
+int segments;
+int kway;			//-k: merge all segments at once instead of in pairs
+int radix;			//-r: radix sort the whole input, no segments
+int segCount;		//segments asked for on the command line
+size_t budget;		//-m: bytes to sort in, runs go to temporary files; 0 sorts in memory
+size_t runValues;	//values per run in an external sort
+size_t readBlock=READ_BLOCK;	//bytes of input parsed per round
+size_t writeBlock=WRITE_BLOCK;	//bytes of binary output the external merge collects per write
+Run *runs;
+int runCount;
+int typed;			//-t, -w: sorting records of typed fields instead of ints
+int keyType=KEY_INT32;
+int fields=1;		//-w: fields in a record
+int keyField;		//-o: which of them is the key
+size_t fieldSize=sizeof(int);
+char *records;		//typed mode's values: recordCount records of fields fields
+size_t recordCount;
+size_t fieldCount, fieldCapacity;
+void (*parseBlock)(const char *text, size_t len)=parseText;	//parseFields() in typed mode
+int binary;			//-b: raw little-endian input and output instead of text
+char *outPath;		//-O: file to write the output to, mapped for binary output
+int outFd=-1;
+char *outMap;		//the mapped output file, NULL when writing with write()
+size_t outSize, outDone;
+void (*netBlock)(int *a);	//sorts NET_BLOCK ints as runs of 8, picked by netInit()
+void (*netMerge)(const int *a, int m, const int *b, int n, int *out);
+Worker workers[MAX_THREADS];
+__thread int self;	//the calling thread's worker, the main thread is 0
+int queued;			//tasks sitting in deques, for sleeping workers
+int sleepers;
+pthread_mutex_t idleLock=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t idleCond=PTHREAD_COND_INITIALIZER;
 
 
 /* Ankoor Shah
@@ -45,192 +437,2177 @@ typedef struct _Result
  */
 int main(int argc, char **argv)
 {
-	if(argc>1)
+	int temp;
+
+
+	while((temp=getopt(argc, argv, "krm:t:w:o:bO:"))!=-1)
+	{
+		if(temp=='k')
+			kway=1;
+		else if(temp=='r')
+			radix=1;
+		else if(temp=='m')
+			budget=strtoull(optarg, NULL, 10)*1024*1024;	//MiB
+		else if(temp=='t')
+			keyType=keyTypeOf(optarg);
+		else if(temp=='w')
+			fields=atoi(optarg);
+		else if(temp=='o')
+			keyField=atoi(optarg);
+		else if(temp=='b')
+			binary=1;
+		else if(temp=='O')
+			outPath=optarg;
+		else
+			return 1;
+	}
+	if(keyType<0 || fields<1 || keyField<0 || keyField>=fields)
+	{
+		fprintf(stderr, "usage: %s [-k] [-r] [-m MiB] [-t int32|int64|uint64|double] [-w fields -o keyfield] [-b] [-O file] segments\n", argv[0]);
+		return 1;
+	}
+	if(!binary && outPath!=NULL && freopen(outPath, "w", stdout)==NULL)
+	{
+		perror(outPath);
+		return 1;
+	}
+	typed=keyType!=KEY_INT32 || fields>1;
+	fieldSize=keyType==KEY_INT32 ? sizeof(int) : sizeof(uint64_t);
+	if(typed && budget>0)
+	{
+		fprintf(stderr, "%s: -m only sorts plain int keys\n", argv[0]);
+		return 1;
+	}
+
+	if(optind<argc)
 	{
 		values=NULL;
 		size=0;
-		int segCount=parse(argv[1]);//apparently everyone besides me knew that parsing was required.. How else do we get the segCount int...
+		segCount=parse(argv[optind]);//apparently everyone besides me knew that parsing was required.. How else do we get the segCount int...
 		int i=0;
-		int numPerSeg=0;
-		pthread_t *tid=malloc(segCount*sizeof(pthread_t));
-		Range *ranges=malloc(segCount*sizeof(Range));
 
 
-		//get all the values
-		while(scanf("%d", &i)!=EOF)
+		//a run and its sort buffer take 80% of the budget and the merge buffers
+		//the same memory later, a block of text and the ints parsed from it
+		//(up to two bytes of them per byte of text) or a block of binary
+		//output under 5% more; values is allocated at full size just once
+		if(budget>0)
 		{
-			size++;
-			values=realloc(values, size*sizeof(int));
-			values[size-1]=i;
+			if(budget<MIN_BUDGET)
+				budget=MIN_BUDGET;
+			runValues=budget/10*4/sizeof(int);
+			if(runValues>INT_MAX)
+				runValues=INT_MAX;
+			if(readBlock>budget/64)
+				readBlock=budget/64;
+			if(writeBlock>readBlock)
+				writeBlock=readBlock;
+			capacity=runValues;
+			values=malloc(capacity*sizeof(int));
 		}
 
-		if(segCount<=size)
+		//get all the values, spilling runs if they do not fit
+		netInit();
+		poolInit();
+		if(typed)
+			parseBlock=parseFields;
+		if(binary)
+			readBinary();
+		else
+			readValues();
+
+		if(typed)
+		{
+			sortRecords();
+			if(binary)
+				writeBinary(records, recordCount*fields*fieldSize);
+			else
+				printRecords();
+			free(records);
+		}
+		else if(runCount>0)
+		{
+			if(size>0)
+				spillRun();
+			externalMerge();
+		}
+		else
 		{
-			numPerSeg=size/segCount;
-			if(size%segCount!=0)
-				numPerSeg++;
+			sortValues();
+			if(binary)
+				writeBinary(values, (size_t)size*sizeof(int));
+			for(i=0; i<size && !binary; i++)
+				printf("%d\n", values[i]);
+		}
+		free(values);
+	}
 
 
-			//begin sorting segments
-			for(i=0; i<segCount-1; i++)
-			{
-				ranges[i].start=i*numPerSeg;
-				ranges[i].end=(i+1)*numPerSeg-1;
-				ranges[i].numValues=numPerSeg;
-				pthread_create(&tid[i], NULL, sortSeg, &ranges[i]);
-			}
-			ranges[i].start=i*numPerSeg;
-			ranges[i].end=size-1;
+	return 0;
+}
+
+
+/*
+ * Sorts the size values in values the way the options ask: one radix sort,
+ * or segCount segments sorted and merged on the pool. Input that is mostly
+ * sorted already is merged along its natural runs instead of segments.
+ */
+void sortValues()
+{
+	int count=segCount<size ? segCount : size;
+	int i;
+
+
+	scratch=malloc((size_t)size*sizeof(int));
+	if(!radix && count>0 && findRuns())
+	{
+		Job all={0, segments-1, values};
+
+		fprintf(stderr, "Found %d natural runs.\n", segments);
+		natural=1;
+		sortJob(&all);
+		if(kway && segments>1)
+			kwayMerge();
+		natural=0;
+		free(ranges);
+	}
+	else if(radix)
+	{
+		int *sorted=radixSort32(values, scratch, size);
+
+		if(sorted!=values)
+		{
+			scratch=values;
+			values=sorted;
+			capacity=size;
+		}
+		fprintf(stderr, "Radix sorted %d elements.\n", size);
+	}
+	else if(count>0)
+	{
+		Job all={0, count-1, values};
+
+		//spread the values evenly, the first size%count get one more
+		ranges=malloc(count*sizeof(Range));
+		for(i=0; i<count; i++)
+		{
+			ranges[i].start=(int)((long long)i*size/count);
+			ranges[i].end=(int)((long long)(i+1)*size/count)-1;
 			ranges[i].numValues=ranges[i].end-ranges[i].start+1;
-			pthread_create(&tid[i], NULL, sortSeg, &ranges[i]);
+		}
+
+		//sort and merge as one fork/join tree on the pool
+		segments=count;
+		sortJob(&all);
+		if(kway && count>1)
+			kwayMerge();
+		free(ranges);
+	}
+	free(scratch);
+	scratch=NULL;
+}
+
+/*
+ * Looks for natural runs, each worker in its own chunk of values: ascending
+ * runs are kept, strictly descending ones reversed in place. A chunk whose
+ * runs average under MIN_NATURAL_RUN values stops early, so random input
+ * costs next to nothing here. Runs that continue across chunk boundaries are
+ * joined. Returns 1 and fills ranges and segments with the runs if they are
+ * long enough to merge as they are, 0 if the input should be sorted.
+ */
+int findRuns()
+{
+	RunScan scan[MAX_THREADS];
+	Task tasks[MAX_THREADS];
+	int parts=size/MIN_MERGE_SPAN;
+	int total=0;
+	int random=0;
+	int p, i;
 
-			Result *temp;
-			for(i=0; i<segCount; i++)
-				pthread_join(tid[i], (void**)&temp);
-			free(tid);
 
+	if(parts>threads)
+		parts=threads;
+	if(parts<1)
+		parts=1;
 
-			//begin merging
-			while(segCount>1)
+	for(p=0; p<parts; p++)
+	{
+		scan[p].first=(int)((long long)size*p/parts);
+		scan[p].end=(int)((long long)size*(p+1)/parts);
+		if(p>0)
+			spawn(&tasks[p], scanRuns, &scan[p]);
+	}
+	scanRuns(&scan[0]);
+	for(p=parts-1; p>0; p--)
+		join(&tasks[p]);
+	for(p=0; p<parts; p++)
+	{
+		random|=scan[p].random;
+		total+=scan[p].count;
+	}
+
+	if(!random && total<=size/MIN_NATURAL_RUN+1)
+	{
+		ranges=malloc(total*sizeof(Range));
+		segments=0;
+		for(p=0; p<parts; p++)
+		{
+			for(i=0; i<scan[p].count; i++)
 			{
-				tid=malloc((segCount/2)*sizeof(pthread_t));
-				for(i=1; i<segCount; i+=2)
-				{
-					ranges[i/2].start=ranges[i-1].start;
-					ranges[i/2].start2=ranges[i].start;
-					ranges[i/2].end=ranges[i].end;
-					ranges[i/2].numValues=ranges[i/2].end-ranges[i/2].start+1;
-					pthread_create(&tid[i/2], NULL, merge, ranges[i/2]);
-				}
-				if(segCount%2!=0 && segCount>4)
+				int start=scan[p].starts[i];
+
+				if(segments>0 && values[start-1]<=values[start])
+					continue;	//carries on the run from the chunk before
+				if(segments>0)
 				{
-					ranges[i/2].start=ranges[segCount-1].start;
-					ranges[i/2].end=ranges[segCount-1].end;
-					ranges[i/2].numValues=ranges[segCount-1].numValues;
+					ranges[segments-1].end=start-1;
+					ranges[segments-1].numValues=start-ranges[segments-1].start;
 				}
+				ranges[segments].start=start;
+				segments++;
+			}
+		}
+		ranges[segments-1].end=size-1;
+		ranges[segments-1].numValues=size-ranges[segments-1].start;
+	}
+
+	for(p=0; p<parts; p++)
+		free(scan[p].starts);
+
+
+	return !random && total<=size/MIN_NATURAL_RUN+1;
+}
+
+/*
+ * Finds the runs in one chunk of values, reversing the descending ones, and
+ * gives up once there are more than RUN_SLACK runs on top of one per
+ * MIN_NATURAL_RUN values scanned.
+ *
+ * @param - RunScan pointer with first and end set
+ * @return - NULL, starts holds where each run begins unless random is set
+ */
+void* scanRuns(void *args)
+{
+	RunScan *scan=(RunScan*)args;
+	int i=scan->first;
+
 
+	scan->starts=NULL;
+	scan->count=0;
+	scan->capacity=0;
+	scan->random=0;
+	while(i<scan->end && !scan->random)
+	{
+		int j=i+1;
 
-				for(i=0; i<segCount/2;i++)
-					pthread_join(tid[i], (void**)&temp);
+		if(j<scan->end && values[j]<values[i])
+		{
+			int lo, hi;
 
-				if(segCount%2==0)
-					segCount/=2;
-				else
-					segCount=segCount/2+1;
+			while(j<scan->end && values[j]<values[j-1])
+				j++;
+			for(lo=i, hi=j-1; lo<hi; lo++, hi--)
+			{
+				int swap=values[lo];
 
-				free(tid);
-				ranges=realloc(ranges, sizeof(Range*segCount));
+				values[lo]=values[hi];
+				values[hi]=swap;
 			}
 		}
+		else
+		{
+			while(j<scan->end && values[j]>=values[j-1])
+				j++;
+		}
 
-
-		free(ranges);
-		free(values);
+		if(scan->count==scan->capacity)
+		{
+			scan->capacity=scan->capacity<64 ? 64 : 2*scan->capacity;
+			scan->starts=realloc(scan->starts, scan->capacity*sizeof(int));
+		}
+		scan->starts[scan->count++]=i;
+		scan->random=scan->count>RUN_SLACK+(j-scan->first)/MIN_NATURAL_RUN;
+		i=j;
 	}
 
 
-	return 0;
+	return NULL;
 }
 
-
-/*sorting function ran in threads
- *
- * @param - start index, end index, and number of elements attached to thread
- * 			 during creation. contained in Range type pointer
- * @return - elements in range are sorted least to greatest
+/*
+ * External sort: sorts what has been read so far with sortValues() and
+ * writes it to a run file as raw ints, then empties values for the next run.
  */
-void* sortSeg(void *args)
+void spillRun()
 {
-	Range *temp=(Range*)args;
-	Result *dummy=NULL;
+	int fd;
 
 
-	qsort(&values[temp->start], temp->numValues, sizeof(int), intCmp);
-	fprintf(stderr, "Sorted %d elements.\n", temp->numValues);
+	sortValues();
 
+	fd=runFile();
+	runWrite(fd, values, (size_t)size*sizeof(int));
+	runAdd(fd, size);
+	fprintf(stderr, "Spilled run %d of %d elements.\n", runCount, size);
 
-	return dummy;
+	//sorting may have swapped values for a buffer of exactly size
+	size=0;
+	if(capacity<runValues)
+	{
+		free(values);
+		capacity=runValues;
+		values=malloc(capacity*sizeof(int));
+	}
 }
 
-//needed for sortSeg's use of qsort
-int intCmp(const void *x, const void *y)
+//opens an unlinked temporary file in $TMPDIR (or /tmp) for a run
+int runFile()
 {
-	return *((const int *)y) - *((const int *)x);
+	const char *dir=getenv("TMPDIR");
+	char path[4096];
+	int fd;
+
+
+	snprintf(path, sizeof(path), "%s/msort.XXXXXX", dir!=NULL && *dir!='\0' ? dir : "/tmp");
+	fd=mkstemp(path);
+	if(fd<0)
+	{
+		perror(path);
+		exit(1);
+	}
+	unlink(path);
+
+
+	return fd;
 }
 
-//needed to parse input string to int
-int parse(char *x)
+//appends len bytes to a run file
+void runWrite(int fd, const void *data, size_t len)
 {
-	int i;
-	int end=strlen(x);
-	int rv=0;
-	for(i=0; i<end; i++)
+	size_t done=0;
+
+
+	while(done<len)
 	{
-		int i2, pow=1;
-		for(i2=0; i2<i; i2++)
-			pow*=10;
+		ssize_t wrote=write(fd, (const char*)data+done, len-done);
 
-		rv+=pow*(x[end-1-i]-48);
+		if(wrote<=0)
+		{
+			perror("spilling a run");
+			exit(1);
+		}
+		done+=wrote;
 	}
+}
+
+//adds a run file of count values to runs
+void runAdd(int fd, size_t count)
+{
+	runs=realloc(runs, (runCount+1)*sizeof(Run));
+	memset(&runs[runCount], 0, sizeof(Run));
+	runs[runCount].fd=fd;
+	runs[runCount].count=count;
+	runCount++;
+}
 
+/*
+ * External sort: merges the spilled runs and writes out the result. The run
+ * buffers share the memory values and scratch had, and none should be under
+ * MIN_RUN_BUFFER, so while there are more runs than that allows the oldest
+ * ones are merged into a new run first.
+ */
+void externalMerge()
+{
+	int fanIn=(int)(runValues/(MIN_RUN_BUFFER/sizeof(int)));	//MIN_BUDGET leaves room for a few
+	int fd;
 
-	return rv;
+
+	free(values);	//the run buffers get its memory
+	values=NULL;
+	capacity=0;
+
+	while(runCount>fanIn)
+	{
+		fd=runFile();
+		mergeRuns(runs, fanIn, fd);
+		runCount-=fanIn;
+		memmove(runs, runs+fanIn, runCount*sizeof(Run));
+		runAdd(fd, lseek(fd, 0, SEEK_CUR)/sizeof(int));
+	}
+	mergeRuns(runs, runCount, -1);
+	free(runs);
 }
 
-/* Merge function ran in threads to complete merge sort. Should run in O(n)
- *
- * @param - args sent by thread, should contain start and end
- * @return - sections representing segments are sorted together
+/*
+ * Merges count runs in one pass through a loser tree into the run file fd,
+ * or with fd -1 into the output: printed, or written out writeBlock bytes at
+ * a time in binary mode. Each run is read through two buffers of
+ * runValues/count ints in large sequential blocks, the next block always
+ * being fetched on the pool while the current one is merged. The runs' files
+ * are closed afterwards.
  */
-void* merge(void *args)
+void mergeRuns(Run *group, int count, int fd)
 {
-	Range *temp=(Range*)args;
-	int sorted[temp->numValues];
-	int dupes=0;
+	uint64_t *key=malloc(count*sizeof(uint64_t));
+	int *tree=malloc(count*sizeof(int));
+	size_t bufValues=runValues/count;
+	int *block=NULL;
+	size_t blockCount=0;
+	long long total=0;
+	int i, v;
 
 
-	int i=temp->start, j=0, k=temp->start2;
-	while(i<temp->start2 && k<=temp->end)
+	for(i=0; i<count; i++)
 	{
-		if(values[i]==values[k])
-		{
-			dupes++;
-			sorted[j]=values[i];
-			i++;
-		}
-		else if(values[i]<values[k])
+		Run *run=&group[i];
+
+		posix_fadvise(run->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		lseek(run->fd, 0, SEEK_SET);
+		run->bufValues=bufValues;
+		run->buf[0]=malloc(bufValues*sizeof(int));
+		run->buf[1]=malloc(bufValues*sizeof(int));
+
+		//first block now, the second one in the background
+		run->cur=1;
+		runFetch(run);
+		run->cur=0;
+		run->pos=0;
+		spawn(&run->fetch, runFetch, run);
+		run->fetching=1;
+		key[i]=runNext(run, &v) ? LEAF_KEY(v, i) : UINT64_MAX;
+		total+=run->count;
+	}
+	treeBuild(key, tree, count);
+	if(binary || fd>=0)
+		block=malloc(writeBlock);
+	if(binary && fd<0)
+		outputOpen(total*sizeof(int));
+
+	total=0;
+	while(key[tree[0]]!=UINT64_MAX)
+	{
+		int w=tree[0];
+
+		v=(int)((uint32_t)(key[w]>>32)^0x80000000u);
+		if(block!=NULL)
 		{
-			sorted[j]=values[i];
-			i++;
+			block[blockCount++]=v;
+			if(blockCount==writeBlock/sizeof(int))
+			{
+				flushBlock(block, blockCount, fd);
+				blockCount=0;
+			}
 		}
 		else
-		{
-			sorted[j]=values[k];
-			k++;
-		}
-		j++;
+			printf("%d\n", v);
+		total++;
+		key[w]=runNext(&group[w], &v) ? LEAF_KEY(v, w) : UINT64_MAX;
+		treeReplay(key, tree, count);
 	}
 
-	//For case when segments are uneven
-	while(i<temp->start2)
+	if(block!=NULL)
+	{
+		flushBlock(block, blockCount, fd);
+		if(fd<0)
+			outputClose();
+		free(block);
+	}
+
+	for(i=0; i<count; i++)
+	{
+		if(group[i].fetching)
+			join(&group[i].fetch);
+		close(group[i].fd);
+		free(group[i].buf[0]);
+		free(group[i].buf[1]);
+	}
+	fprintf(stderr, "Merged %d runs of %lld elements.\n", count, total);
+	free(key);
+	free(tree);
+}
+
+//writes count merged values to the run file fd, or with fd -1 to the binary output
+void flushBlock(int *block, size_t count, int fd)
+{
+	if(fd>=0)
 	{
-		sorted[j]=values[i];
-		i++;
-		j++;
+		runWrite(fd, block, count*sizeof(int));
 	}
-	//The following should never run, but just in case...
-	while(k<=temp->end)
+	else
 	{
-		sorted[j]=values[k];
-		k++;
-		j++;
+		toLittle(block, count*sizeof(int), sizeof(int));
+		outputWrite(block, count*sizeof(int));
 	}
+}
+
+/*
+ * Reads the next stretch of a run into the buffer the merge is not using.
+ * Ran on the pool so the read overlaps merging.
+ *
+ * @param - Run pointer
+ * @return - NULL, have[!cur] holds the number of values read, 0 at the end
+ */
+void* runFetch(void *args)
+{
+	Run *run=(Run*)args;
+	char *into=(char*)run->buf[!run->cur];
+	size_t want=run->bufValues*sizeof(int);
+	size_t got=0;
+
+
+	while(got<want)
+	{
+		ssize_t n=read(run->fd, into+got, want-got);
 
-	//copy array over
-	for(j=0; j<temp->numValues; j++)
+		if(n<0)
+		{
+			perror("reading a run");
+			exit(1);
+		}
+		if(n==0)
+			break;
+		got+=n;
+	}
+	run->have[!run->cur]=got/sizeof(int);
+
+
+	return NULL;
+}
+
+/*
+ * Takes the next value of a run, switching buffers and starting the next
+ * read when the current buffer is used up. Returns 0 once the run is done.
+ */
+int runNext(Run *run, int *v)
+{
+	if(run->pos==run->have[run->cur])
 	{
-		values[temp->start+j]=sorted[j];
+		if(!run->fetching)
+			return 0;
+		join(&run->fetch);
+		run->fetching=0;
+		run->cur=!run->cur;
+		run->pos=0;
+		if(run->have[run->cur]==0)
+			return 0;
+		if(run->have[run->cur]==run->bufValues)
+		{
+			spawn(&run->fetch, runFetch, run);
+			run->fetching=1;
+		}
 	}
+	*v=run->buf[run->cur][run->pos++];
+
+
+	return 1;
 }
 
+//the radix sort engines for -t, called from sortRecords()
+RADIX_SORT(radixSort64, int64_t, INT64_KEY)
+RADIX_SORT(radixSortU64, uint64_t, UINT64_KEY)
+RADIX_SORT(radixSortDouble, double, DOUBLE_KEY)
+RADIX_SORT(radixSortPairs, KeyIndex, PAIR_KEY)
+
+/*
+ * Typed mode: sorts the records by their key field with the radix engine
+ * instantiated for the key type. Records of a single field are sorted as
+ * they are; wider ones by sorting (key, index) pairs and then gathering the
+ * records into their new order, all on the pool. The sort is stable.
+ */
+void sortRecords()
+{
+	size_t recordSize=fields*fieldSize;
+	int parts=(int)(recordCount/MIN_RADIX_SPAN);
+	RecordPart part[MAX_THREADS];
+	Task tasks[MAX_THREADS];
+	int p;
+
+
+	if(parts>threads)
+		parts=threads;
+	if(parts<1)
+		parts=1;
+
+	if(fields==1)
+	{
+		void *tmp=malloc(recordCount*fieldSize);
+		void *sorted=NULL;
+
+		if(keyType==KEY_INT32)
+			sorted=radixSort32((int*)records, tmp, recordCount);
+		else if(keyType==KEY_INT64)
+			sorted=radixSort64((int64_t*)records, tmp, recordCount);
+		else if(keyType==KEY_UINT64)
+			sorted=radixSortU64((uint64_t*)records, tmp, recordCount);
+		else
+			sorted=radixSortDouble((double*)records, tmp, recordCount);
+		free(sorted==records ? tmp : records);
+		records=sorted;
+	}
+	else
+	{
+		KeyIndex *pairs=malloc(recordCount*sizeof(KeyIndex));
+		KeyIndex *tmp=malloc(recordCount*sizeof(KeyIndex));
+		KeyIndex *sorted;
+		char *out=malloc(recordCount*recordSize);
+
+		for(p=0; p<parts; p++)
+		{
+			part[p].first=recordCount*p/parts;
+			part[p].end=recordCount*(p+1)/parts;
+			part[p].pairs=pairs;
+			part[p].out=out;
+			if(p>0)
+				spawn(&tasks[p], keyRecords, &part[p]);
+		}
+		keyRecords(&part[0]);
+		for(p=parts-1; p>0; p--)
+			join(&tasks[p]);
+
+		sorted=radixSortPairs(pairs, tmp, recordCount);
+		for(p=0; p<parts; p++)
+		{
+			part[p].pairs=sorted;
+			if(p>0)
+				spawn(&tasks[p], gatherRecords, &part[p]);
+		}
+		gatherRecords(&part[0]);
+		for(p=parts-1; p>0; p--)
+			join(&tasks[p]);
+
+		free(pairs);
+		free(tmp);
+		free(records);
+		records=out;
+	}
+	fprintf(stderr, "Radix sorted %zu records.\n", recordCount);
+}
+
+/*
+ * Reads the key of each of a part's records into a pair with its index. The
+ * key type is looked at once per part, not once per record.
+ *
+ * @param - RecordPart pointer
+ * @return - NULL, pairs first..end-1 filled in
+ */
+void* keyRecords(void *args)
+{
+	RecordPart *part=(RecordPart*)args;
+	size_t recordSize=fields*fieldSize;
+	const char *key=records+part->first*recordSize+keyField*fieldSize;
+	size_t i;
+
+
+#define KEY_RECORDS(type, ukey) \
+	for(i=part->first; i<part->end; i++, key+=recordSize) \
+	{ \
+		type k; \
+\
+		memcpy(&k, key, sizeof(type)); \
+		part->pairs[i].key=ukey(k); \
+		part->pairs[i].index=i; \
+	}
+	if(keyType==KEY_INT32)
+		KEY_RECORDS(int, INT32_KEY)
+	else if(keyType==KEY_INT64)
+		KEY_RECORDS(int64_t, INT64_KEY)
+	else if(keyType==KEY_UINT64)
+		KEY_RECORDS(uint64_t, UINT64_KEY)
+	else
+		KEY_RECORDS(double, DOUBLE_KEY)
+#undef KEY_RECORDS
+
+
+	return NULL;
+}
+
+//copies records into their sorted places first..end-1 of out
+void* gatherRecords(void *args)
+{
+	RecordPart *part=(RecordPart*)args;
+	size_t recordSize=fields*fieldSize;
+	size_t i;
+
+
+	for(i=part->first; i<part->end; i++)
+		memcpy(part->out+i*recordSize, records+part->pairs[i].index*recordSize, recordSize);
+
+
+	return NULL;
+}
+
+//prints the records one per line, fields separated by spaces
+void printRecords()
+{
+	size_t i;
+	int f;
+
+
+	for(i=0; i<recordCount; i++)
+	{
+		for(f=0; f<fields; f++)
+		{
+			const char *field=records+(i*fields+f)*fieldSize;
+			const char *sep=f+1<fields ? " " : "\n";
+			int32_t i32;
+			int64_t i64;
+			uint64_t u64;
+			double f64;
+
+			if(keyType==KEY_INT32)
+			{
+				memcpy(&i32, field, sizeof(i32));
+				printf("%d%s", i32, sep);
+			}
+			else if(keyType==KEY_INT64)
+			{
+				memcpy(&i64, field, sizeof(i64));
+				printf("%lld%s", (long long)i64, sep);
+			}
+			else if(keyType==KEY_UINT64)
+			{
+				memcpy(&u64, field, sizeof(u64));
+				printf("%llu%s", (unsigned long long)u64, sep);
+			}
+			else
+			{
+				memcpy(&f64, field, sizeof(f64));
+				printf("%.17g%s", f64, sep);
+			}
+		}
+	}
+}
+
+//the KEY_ constant for a -t argument, -1 if there is none
+int keyTypeOf(const char *name)
+{
+	if(strcmp(name, "int32")==0 || strcmp(name, "int")==0)
+		return KEY_INT32;
+	if(strcmp(name, "int64")==0)
+		return KEY_INT64;
+	if(strcmp(name, "uint64")==0)
+		return KEY_UINT64;
+	if(strcmp(name, "double")==0)
+		return KEY_DOUBLE;
+
+
+	return -1;
+}
+
+/*
+ * Radix key of a double: positive values get the sign bit set, negative ones
+ * all bits flipped, so the keys compare like the doubles do. -0 goes right
+ * before 0 and NaNs to whichever end their sign bit says.
+ */
+uint64_t doubleKey(double d)
+{
+	uint64_t bits;
+
+
+	memcpy(&bits, &d, sizeof(bits));
+
+
+	return bits^((uint64_t)((int64_t)bits>>63)|0x8000000000000000ull);
+}
+
+/*sorting function ran in threads
+ *
+ * The segment is read from values, sorted with its stretch of scratch as
+ * working space and left in dst, copied over only if it ended up in the
+ * other buffer. Natural runs are sorted already and only copied if needed.
+ *
+ * @param - start index, end index, and number of elements attached to thread
+ * 			 during creation. contained in Range type pointer
+ * @return - elements in range are sorted least to greatest
+ */
+void* sortSeg(void *args)
+{
+	Range *temp=(Range*)args;
+	int *sorted=&values[temp->start];
+
+
+	if(!natural)
+	{
+		sorted=netSort(&values[temp->start], &scratch[temp->start], temp->numValues);
+		fprintf(stderr, "Sorted %d elements.\n", temp->numValues);
+	}
+	if(sorted!=&temp->dst[temp->start])
+		memcpy(&temp->dst[temp->start], sorted, temp->numValues*sizeof(int));
+
+
+	return NULL;
+}
+
+/*
+ * Sorts segments first..last: a single segment is sorted by sortSeg(),
+ * otherwise the left half is spawned, the right half is done by this thread
+ * and the two runs are merged once both are in. The halves split the values
+ * rather than the segments evenly, so uneven natural runs still make a
+ * balanced tree. Idle workers steal the spawned halves, so uneven segments
+ * keep every core busy.
+ *
+ * The halves are sorted into the other buffer than the one this job has to
+ * fill, so the merge reads from one and writes to the other and every round
+ * flips between values and scratch without copying back.
+ *
+ * @param - Job pointer with the segment indices
+ * @return - values in those segments are sorted least to greatest
+ */
+void* sortJob(void *args)
+{
+	Job *job=(Job*)args;
+
+
+	if(job->first==job->last)
+	{
+		ranges[job->first].dst=job->dst;
+		sortSeg(&ranges[job->first]);
+	}
+	else
+	{
+		int half=ranges[job->first].start+(ranges[job->last].end-ranges[job->first].start)/2;
+		int lo=job->first, hi=job->last-1;
+		int mid=lo;
+		int *src=kway ? job->dst : (job->dst==values ? scratch : values);
+		Job left, right;
+		Range both;
+		Task task;
+
+		//the first segment reaching halfway ends the left half
+		while(lo<hi)
+		{
+			mid=lo+(hi-lo)/2;
+			if(ranges[mid].end<half)
+				lo=mid+1;
+			else
+				hi=mid;
+		}
+		mid=lo;
+		left.first=job->first;
+		left.last=mid;
+		left.dst=src;
+		right.first=mid+1;
+		right.last=job->last;
+		right.dst=src;
+
+		spawn(&task, sortJob, &left);
+		sortJob(&right);
+		join(&task);
+		if(kway)
+			return NULL;	//kwayMerge() does it all at the end
+
+		both.start=ranges[job->first].start;
+		both.start2=ranges[mid+1].start;
+		both.end=ranges[job->last].end;
+		both.numValues=both.end-both.start+1;
+		both.src=src;
+		both.dst=job->dst;
+		merge(&both);
+	}
+
+
+	return NULL;
+}
+
+/*
+ * Picks the sorting network kernels for this CPU: AVX2 where CPUID reports
+ * it, plain C everywhere else.
+ */
+void netInit()
+{
+	netBlock=netBlockScalar;
+	netMerge=netMergeScalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		netBlock=netBlockAvx2;
+		netMerge=netMergeAvx2;
+	}
+#endif
+}
+
+/*
+ * Sorts n ints without a comparison callback. netBlock() sorts every 8 ints
+ * in sorting networks, then runs are merged in pairs by netMerge(): first
+ * inside each NET_CHUNK so those passes stay in cache, then across chunks.
+ * tmp must have room for n ints. Returns a or tmp, whichever the last pass
+ * left the sorted values in.
+ */
+int* netSort(int *a, int *tmp, int n)
+{
+	int chunk, i, len, tail;
+	int *sorted;
+
+
+	for(chunk=0; chunk<n; chunk+=NET_CHUNK)
+	{
+		len=n-chunk<NET_CHUNK ? n-chunk : NET_CHUNK;
+		for(i=0; i+NET_BLOCK<=len; i+=NET_BLOCK)
+			netBlock(&a[chunk+i]);
+
+		//what is left over becomes a single sorted run, any slice of which is a run too
+		for(tail=i; i<len; i++)
+		{
+			int v=a[chunk+i];
+			int j=i;
+
+			for(; j>tail && a[chunk+j-1]>v; j--)
+				a[chunk+j]=a[chunk+j-1];
+			a[chunk+j]=v;
+		}
+
+		sorted=netPasses(&a[chunk], &tmp[chunk], len, 8);
+		if(sorted!=&a[chunk])
+			memcpy(&a[chunk], sorted, len*sizeof(int));
+	}
+
+
+
+	return netPasses(a, tmp, n, NET_CHUNK);
+}
+
+/*
+ * Bottom up merge passes over n ints made of sorted runs of width values,
+ * going back and forth between src and dst. Returns whichever holds the
+ * sorted result.
+ */
+int* netPasses(int *src, int *dst, int n, int width)
+{
+	int i;
+
+
+	for(; width<n; width*=2)
+	{
+		int *swap;
+
+		for(i=0; i<n; i+=2*width)
+		{
+			int m=n-i<width ? n-i : width;
+			int r=n-i-m<width ? n-i-m : width;
+
+			netMerge(&src[i], m, &src[i+m], r, &dst[i]);
+		}
+		swap=src;
+		src=dst;
+		dst=swap;
+	}
+
+
+	return src;
+}
+
+//sorts every 8 of the NET_BLOCK ints at a by insertion
+void netBlockScalar(int *a)
+{
+	int i, j;
+
+
+	for(i=0; i<NET_BLOCK; i++)
+	{
+		int v=a[i];
+
+		for(j=i; j%8>0 && a[j-1]>v; j--)
+			a[j]=a[j-1];
+		a[j]=v;
+	}
+}
+
+//merges sorted a (m values) and b (n values) into out
+void netMergeScalar(const int *a, int m, const int *b, int n, int *out)
+{
+	const int *aEnd=a+m, *bEnd=b+n;
+
+
+	while(a<aEnd && b<bEnd)
+	{
+		int takeA=*a<=*b;
+
+		*out++=takeA ? *a : *b;
+		a+=takeA;
+		b+=!takeA;
+	}
+	memcpy(out, a, (aEnd-a)*sizeof(int));
+	out+=aEnd-a;
+	memcpy(out, b, (bEnd-b)*sizeof(int));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Bitonic merge of two sorted vectors of 8: afterwards lo holds the smallest
+ * 8 of the 16 and hi the biggest 8, both sorted.
+ */
+__attribute__((target("avx2")))
+static inline void bitonicMerge8(__m256i *lo, __m256i *hi)
+{
+	__m256i l, h, t, mn, mx;
+	__m256i reverse=_mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	int i;
+
+
+	h=_mm256_permutevar8x32_epi32(*hi, reverse);
+	l=_mm256_min_epi32(*lo, h);
+	h=_mm256_max_epi32(*lo, h);
+
+	//each half is bitonic now, sort both at distances 4, 2 and 1
+	for(i=0; i<2; i++)
+	{
+		__m256i x=i==0 ? l : h;
+
+		t=_mm256_permute2x128_si256(x, x, 0x01);
+		mn=_mm256_min_epi32(x, t);
+		mx=_mm256_max_epi32(x, t);
+		x=_mm256_blend_epi32(mn, mx, 0xf0);
+		t=_mm256_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2));
+		mn=_mm256_min_epi32(x, t);
+		mx=_mm256_max_epi32(x, t);
+		x=_mm256_blend_epi32(mn, mx, 0xcc);
+		t=_mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1));
+		mn=_mm256_min_epi32(x, t);
+		mx=_mm256_max_epi32(x, t);
+		x=_mm256_blend_epi32(mn, mx, 0xaa);
+		if(i==0)
+			l=x;
+		else
+			h=x;
+	}
+	*lo=l;
+	*hi=h;
+}
+
+/*
+ * Sorts the 8 columns of an 8x8 block of ints with the 19 comparator sorting
+ * network, one comparator per min/max pair over all columns at once, then
+ * transposes so every row of 8 is sorted.
+ */
+__attribute__((target("avx2")))
+void netBlockAvx2(int *a)
+{
+	__m256i r[8], t[8], u[8];
+	int i;
+
+
+	for(i=0; i<8; i++)
+		r[i]=_mm256_loadu_si256((const __m256i*)&a[i*8]);
+
+#define NET_CMP(x, y) { __m256i mn=_mm256_min_epi32(r[x], r[y]); r[y]=_mm256_max_epi32(r[x], r[y]); r[x]=mn; }
+	NET_CMP(0, 1) NET_CMP(2, 3) NET_CMP(4, 5) NET_CMP(6, 7)
+	NET_CMP(0, 2) NET_CMP(1, 3) NET_CMP(4, 6) NET_CMP(5, 7)
+	NET_CMP(1, 2) NET_CMP(5, 6) NET_CMP(0, 4) NET_CMP(3, 7)
+	NET_CMP(1, 5) NET_CMP(2, 6)
+	NET_CMP(1, 4) NET_CMP(3, 6)
+	NET_CMP(2, 4) NET_CMP(3, 5)
+	NET_CMP(3, 4)
+#undef NET_CMP
+
+	for(i=0; i<8; i+=2)
+	{
+		t[i]=_mm256_unpacklo_epi32(r[i], r[i+1]);
+		t[i+1]=_mm256_unpackhi_epi32(r[i], r[i+1]);
+	}
+	for(i=0; i<8; i+=4)
+	{
+		u[i]=_mm256_unpacklo_epi64(t[i], t[i+2]);
+		u[i+1]=_mm256_unpackhi_epi64(t[i], t[i+2]);
+		u[i+2]=_mm256_unpacklo_epi64(t[i+1], t[i+3]);
+		u[i+3]=_mm256_unpackhi_epi64(t[i+1], t[i+3]);
+	}
+	for(i=0; i<4; i++)
+	{
+		r[i]=_mm256_permute2x128_si256(u[i], u[i+4], 0x20);
+		r[i+4]=_mm256_permute2x128_si256(u[i], u[i+4], 0x31);
+	}
+
+	for(i=0; i<8; i++)
+		_mm256_storeu_si256((__m256i*)&a[i*8], r[i]);
+}
+
+/*
+ * Merges sorted a (m values) and b (n values) into out 8 at a time: hi keeps
+ * the biggest 8 seen so far, the next 8 come from whichever input has the
+ * smaller head, and each bitonic merge writes out the smallest 8. What is
+ * left when an input runs low goes through the scalar merge.
+ */
+__attribute__((target("avx2")))
+void netMergeAvx2(const int *a, int m, const int *b, int n, int *out)
+{
+	const int *aEnd=a+m, *bEnd=b+n;
+	__m256i lo, hi;
+	int top[8], last[8+7];
+	const int **shortSide, *shortEnd, *longSide, *longEnd;
+
+
+	if(m<8 || n<8)
+	{
+		netMergeScalar(a, m, b, n, out);
+		return;
+	}
+
+	lo=_mm256_loadu_si256((const __m256i*)a);
+	hi=_mm256_loadu_si256((const __m256i*)b);
+	a+=8;
+	b+=8;
+	bitonicMerge8(&lo, &hi);
+	_mm256_storeu_si256((__m256i*)out, lo);
+	out+=8;
+
+	while(aEnd-a>=8 && bEnd-b>=8)
+	{
+		if(*a<*b)
+		{
+			lo=_mm256_loadu_si256((const __m256i*)a);
+			a+=8;
+		}
+		else
+		{
+			lo=_mm256_loadu_si256((const __m256i*)b);
+			b+=8;
+		}
+		bitonicMerge8(&lo, &hi);
+		_mm256_storeu_si256((__m256i*)out, lo);
+		out+=8;
+	}
+
+	//hi and the short side fit in last, then that merges with the long side
+	shortSide=aEnd-a<8 ? &a : &b;
+	shortEnd=aEnd-a<8 ? aEnd : bEnd;
+	longSide=aEnd-a<8 ? b : a;
+	longEnd=aEnd-a<8 ? bEnd : aEnd;
+	_mm256_storeu_si256((__m256i*)top, hi);
+	netMergeScalar(top, 8, *shortSide, shortEnd-*shortSide, last);
+	netMergeScalar(last, 8+(shortEnd-*shortSide), longSide, longEnd-longSide, out);
+}
+#endif
+
+//needed to parse input string to int
+int parse(char *x)
+{
+	int i;
+	int end=strlen(x);
+	int rv=0;
+	for(i=0; i<end; i++)
+	{
+		int i2, pow=1;
+		for(i2=0; i2<i; i2++)
+			pow*=10;
+
+		rv+=pow*(x[end-1-i]-48);
+	}
+
+
+	return rv;
+}
+
+/* Merge function ran in threads to complete merge sort. Should run in O(n)
+ *
+ * The merge is cut into parts along its merge path: coRank() tells how many
+ * values of each run make up the first k of the output, so every part knows
+ * exactly what it reads and where it writes and they all run in parallel.
+ * A merge gets a share of the workers matching its share of the array, so
+ * the final merge of the whole array uses all of them. The runs are read from
+ * src and merged straight into dst, so nothing is allocated or copied back.
+ *
+ * @param - args sent by thread, should contain start and end, src and dst
+ * @return - sections representing segments are sorted together
+ */
+void* merge(void *args)
+{
+	Range *temp=(Range*)args;
+	const int *a=&temp->src[temp->start], *b=&temp->src[temp->start2];
+	int m=temp->start2-temp->start;
+	int n=temp->end-temp->start2+1;
+	int parts=(int)(((long long)threads*temp->numValues+size-1)/size);
+	int dupes=0;
+	MergePart part[MAX_THREADS];
+	Task tasks[MAX_THREADS];
+	int p;
+
+
+	if(parts>temp->numValues/MIN_MERGE_SPAN)
+		parts=temp->numValues/MIN_MERGE_SPAN;
+	if(parts<1)
+		parts=1;
+
+	for(p=0; p<parts; p++)
+	{
+		int k=(int)((long long)temp->numValues*p/parts);
+		int kEnd=(int)((long long)temp->numValues*(p+1)/parts);
+		int i=coRank(k, a, m, b, n);
+		int iEnd=coRank(kEnd, a, m, b, n);
+
+		part[p].a=a+i;
+		part[p].m=iEnd-i;
+		part[p].b=b+k-i;
+		part[p].n=(kEnd-iEnd)-(k-i);
+		part[p].out=&temp->dst[temp->start+k];
+		if(p>0)
+			spawn(&tasks[p], mergePart, &part[p]);
+	}
+	mergePart(&part[0]);
+	for(p=parts-1; p>0; p--)
+		join(&tasks[p]);
+	for(p=0; p<parts; p++)
+		dupes+=part[p].dupes;
+
+	fprintf(stderr, "Merged %d and %d elements with %d duplicates.\n", m, n, dupes);
+
+
+	return NULL;
+}
+
+/*
+ * Merges one part of a merge, taking from a first on ties so the merge is
+ * stable, and counts the ties.
+ *
+ * @param - MergePart pointer
+ * @return - m+n values merged into out, dupes set
+ */
+void* mergePart(void *args)
+{
+	MergePart *part=(MergePart*)args;
+	const int *a=part->a, *aEnd=part->a+part->m;
+	const int *b=part->b, *bEnd=part->b+part->n;
+	int *out=part->out;
+	int dupes=0;
+
+
+	while(a<aEnd && b<bEnd)
+	{
+		if(*a==*b)
+			dupes++;
+		if(*a<=*b)
+			*out++=*a++;
+		else
+			*out++=*b++;
+	}
+
+	//For case when segments are uneven
+	memcpy(out, a, (aEnd-a)*sizeof(int));
+	out+=aEnd-a;
+	memcpy(out, b, (bEnd-b)*sizeof(int));
+	part->dupes=dupes;
+
+
+	return NULL;
+}
+
+/*
+ * Merges all sorted segments in a single pass over memory instead of
+ * log2(segments) rounds of pairs. The output is cut into equal parts, each
+ * part finds where it starts in every segment with kwaySplit() and merges
+ * its share through a loser tree, all parts in parallel. The merge goes to
+ * scratch and the two buffers trade places, so nothing is copied back.
+ */
+void kwayMerge()
+{
+	int *sorted=scratch;
+	int parts=size/MIN_MERGE_SPAN;
+	int dupes=0;
+	KwayPart part[MAX_THREADS];
+	Task tasks[MAX_THREADS];
+	int p;
+
+
+	if(parts>threads)
+		parts=threads;
+	if(parts<1)
+		parts=1;
+
+	for(p=0; p<parts; p++)
+	{
+		part[p].first=(long)size*p/parts;
+		part[p].last=(long)size*(p+1)/parts-1;
+		part[p].out=sorted;
+		if(p>0)
+			spawn(&tasks[p], kwayPart, &part[p]);
+	}
+	kwayPart(&part[0]);
+	for(p=parts-1; p>0; p--)
+	{
+		join(&tasks[p]);
+		dupes+=part[p].dupes;
+	}
+	dupes+=part[0].dupes;
+
+	scratch=values;
+	values=sorted;
+	capacity=size;
+	fprintf(stderr, "Merged %d segments of %d elements with %d duplicates.\n", segments, size, dupes);
+}
+
+/*
+ * Merges one part of the k-way merge with a tournament tree of losers, so
+ * each value out costs one walk up from the winner's leaf. Keys carry the
+ * segment in the low half, so ties go to the earlier segment like the cuts
+ * in kwaySplit() do, and a finished segment is just the biggest key.
+ *
+ * @param - KwayPart pointer
+ * @return - ranks first..last of the merged values written to out
+ */
+void* kwayPart(void *args)
+{
+	KwayPart *part=(KwayPart*)args;
+	int k=segments;
+	int *pos=malloc(2*k*sizeof(int));	//where this part starts and ends in each segment
+	int *stop=pos+k;
+	uint64_t *key=malloc(k*sizeof(uint64_t));
+	int *tree=malloc(k*sizeof(int));
+	int *out=&part->out[part->first];
+	int *outEnd=&part->out[part->last+1];
+	int dupes=0;
+	int i;
+
+
+	kwaySplit(part->first, pos);
+	kwaySplit(part->last+1, stop);
+	for(i=0; i<k; i++)
+	{
+		if(pos[i]<stop[i])
+			key[i]=LEAF_KEY(values[ranges[i].start+pos[i]], i);
+		else
+			key[i]=UINT64_MAX;
+	}
+	treeBuild(key, tree, k);
+
+	while(out<outEnd)
+	{
+		int w=tree[0];
+		int v=values[ranges[w].start+pos[w]];
+
+		if(out>&part->out[part->first] && out[-1]==v)
+			dupes++;
+		*out++=v;
+
+		//refill the winner's leaf and replay its path
+		if(++pos[w]<stop[w])
+			key[w]=LEAF_KEY(values[ranges[w].start+pos[w]], w);
+		else
+			key[w]=UINT64_MAX;
+		treeReplay(key, tree, k);
+	}
+
+	part->dupes=dupes;
+	free(pos);
+	free(key);
+	free(tree);
+
+
+	return NULL;
+}
+
+/*
+ * Plays the first round of a loser tree over k leaves. Leaf i is node k+i,
+ * node n keeps the loser of the match played there and tree[0] the overall
+ * winner.
+ */
+void treeBuild(const uint64_t *key, int *tree, int k)
+{
+	int *win=malloc(2*k*sizeof(int));	//winner of each match
+	int i, node;
+
+
+	for(i=0; i<k; i++)
+		win[k+i]=i;
+	for(node=k-1; node>0; node--)
+	{
+		int a=win[2*node], b=win[2*node+1];
+
+		win[node]=key[a]<key[b] ? a : b;
+		tree[node]=key[a]<key[b] ? b : a;
+	}
+	tree[0]=win[1];
+	free(win);
+}
+
+//replays the matches on the path of the winner's leaf after its key changed
+void treeReplay(const uint64_t *key, int *tree, int k)
+{
+	int w=tree[0];
+	int node;
+
+
+	for(node=(k+w)/2; node>0; node/=2)
+	{
+		if(key[tree[node]]<key[w])
+		{
+			int loser=w;
+
+			w=tree[node];
+			tree[node]=loser;
+		}
+	}
+	tree[0]=w;
+}
+
+/*
+ * Multisequence selection: fills pos with how many values of each segment
+ * make up the first r values of the merge. Binary searches the value range
+ * for the r-th smallest value v, takes everything below v from every segment
+ * and the copies of v from the earliest segments, so neighbouring parts
+ * always agree on the cut.
+ */
+void kwaySplit(long r, int *pos)
+{
+	long long lo=INT_MIN, hi=INT_MAX;
+	long below=0;
+	int i;
+
+
+	if(r>=size)
+	{
+		for(i=0; i<segments; i++)
+			pos[i]=ranges[i].numValues;
+		return;
+	}
+
+	//smallest v with more than r values <= v
+	while(lo<hi)
+	{
+		long long v=(lo+hi)>>1;
+		long count=0;
+
+		for(i=0; i<segments; i++)
+			count+=rankOf(&values[ranges[i].start], ranges[i].numValues, v+1);
+		if(count>r)
+			hi=v;
+		else
+			lo=v+1;
+	}
+
+	for(i=0; i<segments; i++)
+	{
+		pos[i]=rankOf(&values[ranges[i].start], ranges[i].numValues, lo);
+		below+=pos[i];
+	}
+	for(i=0; i<segments && below<r; i++)
+	{
+		long equal=rankOf(&values[ranges[i].start], ranges[i].numValues, lo+1)-pos[i];
+
+		if(equal>r-below)
+			equal=r-below;
+		pos[i]+=equal;
+		below+=equal;
+	}
+}
+
+//number of values in sorted a[0..n-1] less than v
+int rankOf(const int *a, int n, long long v)
+{
+	int lo=0, hi=n;
+
+
+	while(lo<hi)
+	{
+		int mid=lo+(hi-lo)/2;
+
+		if(a[mid]<v)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+
+
+	return lo;
+}
+
+/*
+ * Co-ranking on the merge path: how many of the first k values of a stable
+ * merge of a (m values) and b (n values) come from a. That is the smallest i
+ * with b[k-i-1] < a[i], found by binary search in O(log(m+n)).
+ */
+int coRank(int k, const int *a, int m, const int *b, int n)
+{
+	int lo=k>n ? k-n : 0;
+	int hi=k<m ? k : m;
+
+
+	while(lo<hi)
+	{
+		int i=lo+(hi-lo)/2;
+
+		if(b[k-i-1]<a[i])
+			hi=i;
+		else
+			lo=i+1;
+	}
+
+
+	return lo;
+}
+
+/*
+ * Reads every integer on stdin into values. A regular file is mapped and
+ * parsed in one go; anything else is read readBlock bytes at a time and the
+ * number cut off at the end of a block is carried over to the next one. With
+ * a budget a file is read like a pipe too, since the page cache maps a file
+ * in pieces of up to 2MB whatever the block, and a run is spilled before any
+ * block that might not fit in values.
+ */
+void readValues()
+{
+	struct stat st;
+	char *text;
+
+
+	if(budget==0 && fstat(STDIN_FILENO, &st)==0 && S_ISREG(st.st_mode) && st.st_size>0
+			&& (text=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0))!=MAP_FAILED)
+	{
+		madvise(text, st.st_size, MADV_SEQUENTIAL);
+		parseBlock(text, st.st_size);
+		munmap(text, st.st_size);
+	}
+	else
+	{
+		size_t have=0;
+		ssize_t got=1;
+
+		text=malloc(readBlock);
+		while(got>0)
+		{
+			size_t cut;
+
+			got=read(STDIN_FILENO, text+have, readBlock-have);
+			if(got>0)
+				have+=got;
+
+			//parse up to the last separator, or everything at EOF
+			cut=have;
+			if(got>0)
+			{
+				while(cut>0 && inToken(text[cut-1]))
+					cut--;
+				if(cut==0 && have==readBlock)//one huge token, nothing to carry it in
+					cut=have;
+			}
+			if(cut>0 && (have==readBlock || got<=0))
+			{
+				if(budget>0 && size+readBlock/2>runValues)
+					spillRun();
+				parseBlock(text, cut);
+				memmove(text, text+cut, have-cut);
+				have-=cut;
+			}
+		}
+		free(text);
+	}
+
+
+	return;
+}
+
+//whether c can be part of a number, so a block must not be cut after it
+int inToken(char c)
+{
+	if(typed)
+		return c!=' ' && c!='\n' && c!='\t' && c!='\r';
+
+
+	return c=='-' || (c>='0' && c<='9');
+}
+
+/*
+ * Makes sure buf, which has room for *cap items of width bytes, can hold need
+ * of them. The capacity doubles, starting at 1024.
+ *
+ * @return - the buffer, moved if it had to grow
+ */
+void* growBuffer(void *buf, size_t *cap, size_t need, size_t width)
+{
+	if(need>*cap)
+	{
+		while(*cap<need)
+			*cap=*cap<1024 ? 1024 : 2*(*cap);
+		buf=realloc(buf, *cap*width);
+	}
+
+
+	return buf;
+}
+
+/*
+ * Cuts a block of text that does not end in the middle of a token into one
+ * piece per worker, none shorter than MIN_PARSE_SPAN, moving each cut past
+ * the token it lands in. The pieces are parsed by span in parallel on the
+ * pool; their buffers are kept for the next block.
+ *
+ * @return - the parsed pieces in order, *count of them
+ */
+Parsed* parsePieces(const char *text, size_t len, void* (*span)(void *args), int *count)
+{
+	static Parsed parsed[MAX_THREADS];
+	Task tasks[MAX_THREADS];
+	int pieces=threads;
+	int i;
+	const char *cut=text;
+
+
+	if(len/MIN_PARSE_SPAN<(size_t)pieces)
+		pieces=len/MIN_PARSE_SPAN>0 ? (int)(len/MIN_PARSE_SPAN) : 1;
+
+	for(i=0; i<pieces; i++)
+	{
+		parsed[i].start=cut;
+		cut=i==pieces-1 ? text+len : text+len/pieces*(i+1);
+		while(cut<text+len && inToken(*cut))
+			cut++;
+		parsed[i].end=cut;
+		if(i>0)
+			spawn(&tasks[i], span, &parsed[i]);
+	}
+	span(&parsed[0]);
+	for(i=pieces-1; i>0; i--)
+		join(&tasks[i]);
+	*count=pieces;
+
+
+	return parsed;
+}
+
+/*
+ * Parses a block of text that does not end in the middle of a number and
+ * appends what it finds to values, piece by piece in order.
+ */
+void parseText(const char *text, size_t len)
+{
+	int pieces;
+	Parsed *parsed=parsePieces(text, len, parseSpan, &pieces);
+	size_t total=size;
+	int i;
+
+
+	for(i=0; i<pieces; i++)
+		total+=parsed[i].count;
+	values=growBuffer(values, &capacity, total, sizeof(int));
+	for(i=0; i<pieces; i++)
+	{
+		memcpy(&values[size], parsed[i].values, parsed[i].count*sizeof(int));
+		size+=parsed[i].count;
+	}
+
+
+	return;
+}
+
+/*
+ * Parses the integers in one piece of text into its Parsed buffer. Eight
+ * bytes are classified at a time: a byte is a digit when its high nibble is
+ * 3 both as is and after adding 6, so the length of a number is the position
+ * of the first non-digit byte. Its digits are then shifted to the top of the
+ * word and combined pairwise (SWAR), three multiplications for up to eight
+ * digits. The last few bytes of the piece are done one at a time.
+ *
+ * @param - Parsed pointer with start and end set
+ * @return - NULL, count and values hold the numbers found
+ */
+void* parseSpan(void *args)
+{
+	static const int64_t pow10[9]={1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+	Parsed *piece=(Parsed*)args;
+	const char *p=piece->start;
+	const char *end=piece->end;
+
+
+	piece->count=0;
+	while(p<end)
+	{
+		int negative=0;
+		int digits=0;
+		int len=8;	//digits found by the last 8-byte step
+		int64_t number=0;
+
+		while(p<end && *p!='-' && (*p<'0' || *p>'9'))
+			p++;
+		if(p<end && *p=='-')
+		{
+			negative=1;
+			p++;
+		}
+
+		while(p+8<=end && len==8)
+		{
+			uint64_t chunk, bad, t;
+
+			memcpy(&chunk, p, 8);
+			bad=((chunk&0xF0F0F0F0F0F0F0F0ULL)^0x3030303030303030ULL)
+					| (((chunk+0x0606060606060606ULL)&0xF0F0F0F0F0F0F0F0ULL)^0x3030303030303030ULL);
+			len=bad!=0 ? __builtin_ctzll(bad)>>3 : 8;
+			if(len>0)
+			{
+				t=(chunk-0x3030303030303030ULL)<<(64-8*len);
+				t=((t&0x0F0F0F0F0F0F0F0FULL)*2561)>>8;
+				t=((t&0x00FF00FF00FF00FFULL)*6553601)>>16;
+				t=((t&0x0000FFFF0000FFFFULL)*42949672960001ULL)>>32;
+				number=number*pow10[len]+(int64_t)t;
+				digits+=len;
+				p+=len;
+			}
+		}
+		while(p<end && *p>='0' && *p<='9')
+		{
+			number=number*10+(*p-'0');
+			digits++;
+			p++;
+		}
+
+		if(digits>0)
+		{
+			if(piece->count==piece->capacity)
+				piece->values=growBuffer(piece->values, &piece->capacity, piece->count+1, sizeof(int));
+			((int*)piece->values)[piece->count++]=(int)(negative ? -number : number);
+		}
+	}
+
+
+	return NULL;
+}
+
+
+
+
+/*
+ * Typed mode's parseText(): parses the pieces into fields of the key type and
+ * appends them to records in order. Fields make records fields at a time
+ * across line breaks; an incomplete last record is dropped at the end.
+ */
+void parseFields(const char *text, size_t len)
+{
+	int pieces;
+	Parsed *parsed=parsePieces(text, len, parseFieldSpan, &pieces);
+	size_t total=fieldCount;
+	int i;
+
+
+	for(i=0; i<pieces; i++)
+		total+=parsed[i].count;
+	records=growBuffer(records, &fieldCapacity, total, fieldSize);
+	for(i=0; i<pieces; i++)
+	{
+		memcpy(records+fieldCount*fieldSize, parsed[i].values, parsed[i].count*fieldSize);
+		fieldCount+=parsed[i].count;
+	}
+	recordCount=fieldCount/fields;
+}
+
+/*
+ * Parses the whitespace separated numbers of one piece as the key type.
+ * Tokens are copied out before strtoll() and friends see them, since the
+ * text is not terminated; ones that do not parse are skipped.
+ *
+ * @param - Parsed pointer with start and end set
+ * @return - NULL, count and values hold the fields found
+ */
+void* parseFieldSpan(void *args)
+{
+	Parsed *piece=(Parsed*)args;
+	const char *p=piece->start;
+	char token[MAX_TOKEN+1];
+
+
+	piece->count=0;
+	while(p<piece->end)
+	{
+		const char *start;
+		char *end;
+		int len;
+		int32_t i32;
+		int64_t i64;
+		uint64_t u64;
+		double f64;
+		void *field=&f64;
+
+		while(p<piece->end && !inToken(*p))
+			p++;
+		for(start=p; p<piece->end && inToken(*p); p++)
+			;
+		if(p==start)
+			break;
+		len=p-start<MAX_TOKEN ? (int)(p-start) : MAX_TOKEN;
+		memcpy(token, start, len);
+		token[len]='\0';
+
+		if(keyType==KEY_INT32)
+		{
+			i32=(int32_t)strtol(token, &end, 10);
+			field=&i32;
+		}
+		else if(keyType==KEY_INT64)
+		{
+			i64=strtoll(token, &end, 10);
+			field=&i64;
+		}
+		else if(keyType==KEY_UINT64)
+		{
+			u64=strtoull(token, &end, 10);
+			field=&u64;
+		}
+		else
+			f64=strtod(token, &end);
+		if(end==token)
+			continue;
+
+		if(piece->count==piece->capacity)
+			piece->values=growBuffer(piece->values, &piece->capacity, piece->count+1, fieldSize);
+		memcpy((char*)piece->values+piece->count*fieldSize, field, fieldSize);
+		piece->count++;
+	}
+
+
+	return NULL;
+}
+
+/*
+ * Binary mode's readValues(): the input is raw little-endian ints, or fields
+ * of the key type in typed mode. A regular file is mapped and copied over as
+ * it is, anything else read readBlock bytes at a time, carrying a value cut
+ * in half over to the next read. With a budget a file is read like a pipe,
+ * as in readValues().
+ */
+void readBinary()
+{
+	size_t width=typed ? fieldSize : sizeof(int);
+	struct stat st;
+	char *data;
+
+
+	if(budget==0 && fstat(STDIN_FILENO, &st)==0 && S_ISREG(st.st_mode) && st.st_size>0
+			&& (data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0))!=MAP_FAILED)
+	{
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		loadBinary(data, st.st_size/width*width);
+		munmap(data, st.st_size);
+	}
+	else
+	{
+		size_t have=0;
+		ssize_t got=1;
+
+		data=malloc(readBlock);
+		while(got>0)
+		{
+			got=read(STDIN_FILENO, data+have, readBlock-have);
+			if(got>0)
+				have+=got;
+			if(have==readBlock || (got<=0 && have>0))
+			{
+				size_t whole=have/width*width;
+
+				loadBinary(data, whole);
+				memmove(data, data+whole, have-whole);
+				have-=whole;
+			}
+		}
+		free(data);
+	}
+}
+
+/*
+ * Appends len bytes of raw values to values, or to records in typed mode.
+ * With a budget a run is spilled whenever values is full and more follow.
+ */
+void loadBinary(const char *data, size_t len)
+{
+	if(typed)
+	{
+		size_t count=len/fieldSize;
+
+		records=growBuffer(records, &fieldCapacity, fieldCount+count, fieldSize);
+		memcpy(records+fieldCount*fieldSize, data, len);
+		toLittle(records+fieldCount*fieldSize, len, fieldSize);
+		fieldCount+=count;
+		recordCount=fieldCount/fields;
+		return;
+	}
+
+	while(len>0)
+	{
+		size_t count=len/sizeof(int);
+
+		if(budget>0 && (size_t)size==runValues)
+			spillRun();
+		if(budget>0 && count>runValues-size)
+			count=runValues-size;
+		values=growBuffer(values, &capacity, size+count, sizeof(int));
+		memcpy(&values[size], data, count*sizeof(int));
+		toLittle(&values[size], count*sizeof(int), sizeof(int));
+		size+=count;
+		data+=count*sizeof(int);
+		len-=count*sizeof(int);
+	}
+}
+
+/*
+ * Swaps values of width bytes between little-endian and the host's order,
+ * which is nothing at all on little-endian hosts.
+ */
+void toLittle(void *data, size_t len, size_t width)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+	unsigned char *p=data;
+	size_t i, j;
+
+
+	for(i=0; i+width<=len; i+=width)
+	{
+		for(j=0; j<width/2; j++)
+		{
+			unsigned char swap=p[i+j];
+
+			p[i+j]=p[i+width-1-j];
+			p[i+width-1-j]=swap;
+		}
+	}
+#else
+	(void)data;
+	(void)len;
+	(void)width;
+#endif
+}
+
+//writes a whole sorted buffer in binary, it is turned little-endian in place
+void writeBinary(void *data, size_t len)
+{
+	toLittle(data, len, typed ? fieldSize : sizeof(int));
+	outputOpen(len);
+	outputWrite(data, len);
+	outputClose();
+}
+
+/*
+ * Opens binary output of len bytes: with -O the file is sized up front and
+ * mapped, prefaulted with MAP_POPULATE, so the sorted values are copied
+ * straight into the page cache. Without -O, with a budget the mapping would
+ * not fit in, or if mapping fails, output goes out with write().
+ */
+void outputOpen(size_t len)
+{
+	outFd=STDOUT_FILENO;
+	outMap=NULL;
+	outSize=len;
+	outDone=0;
+	if(outPath==NULL)
+		return;
+
+	outFd=open(outPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(outFd<0 || ftruncate(outFd, len)<0)
+	{
+		perror(outPath);
+		exit(1);
+	}
+	if(len>0 && budget==0)
+	{
+		outMap=mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, outFd, 0);
+		if(outMap==MAP_FAILED)
+			outMap=NULL;
+		else
+			madvise(outMap, len, MADV_SEQUENTIAL);
+	}
+}
+
+//appends len bytes to the binary output
+void outputWrite(const void *data, size_t len)
+{
+	size_t done=0;
+
+
+	if(outMap!=NULL)
+	{
+		memcpy(outMap+outDone, data, len);
+		outDone+=len;
+		return;
+	}
+
+	while(done<len)
+	{
+		ssize_t wrote=write(outFd, (const char*)data+done, len-done);
+
+		if(wrote<=0)
+		{
+			perror("writing output");
+			exit(1);
+		}
+		done+=wrote;
+	}
+	outDone+=len;
+}
+
+//finishes binary output, unmapping and closing the -O file
+void outputClose()
+{
+	if(outMap!=NULL)
+		munmap(outMap, outSize);
+	if(outFd>=0 && outFd!=STDOUT_FILENO)
+		close(outFd);
+	outMap=NULL;
+	outFd=-1;
+}
+
+/*
+ * Starts one worker per online CPU besides the main thread, which is worker 0
+ * and works through tasks whenever it waits in join(). The workers live for
+ * the rest of the program, so no task ever pays for creating a thread.
+ */
+void poolInit()
+{
+	long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+
+	threads=cpus<1 ? 1 : (cpus>MAX_THREADS ? MAX_THREADS : (int)cpus);
+	for(i=0; i<threads; i++)
+	{
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].seed=i+1;
+		if(i>0)
+			pthread_create(&workers[i].tid, NULL, workerLoop, &workers[i]);
+	}
+
+
+	return;
+}
+
+/*
+ * Body of every pool thread: run whatever can be found, and sleep while no
+ * deque holds anything.
+ */
+void* workerLoop(void *args)
+{
+	Task *task;
+
+
+	self=(Worker*)args-workers;
+	while(1)
+	{
+		task=findTask();
+		if(task!=NULL)
+		{
+			task->run(task->args);
+			__atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			pthread_mutex_lock(&idleLock);
+			sleepers++;
+			while(__atomic_load_n(&queued, __ATOMIC_ACQUIRE)==0)
+				pthread_cond_wait(&idleCond, &idleLock);
+			sleepers--;
+			pthread_mutex_unlock(&idleLock);
+		}
+	}
+
+
+	return NULL;
+}
+
+/*
+ * Pushes a task onto the calling worker's deque, where it waits to be popped
+ * by join() or stolen. If the deque is full the task just runs right away.
+ */
+void spawn(Task *task, void* (*run)(void *args), void *args)
+{
+	Worker *me=&workers[self];
+	int pushed=0;
+
+
+	task->run=run;
+	task->args=args;
+	task->done=0;
+
+	pthread_mutex_lock(&me->lock);
+	if(me->bottom-me->top<DEQUE_SIZE)
+	{
+		me->deque[me->bottom%DEQUE_SIZE]=task;
+		me->bottom++;
+		pushed=1;
+	}
+	pthread_mutex_unlock(&me->lock);
+
+	if(pushed)
+	{
+		__atomic_add_fetch(&queued, 1, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&idleLock);
+		if(sleepers>0)
+			pthread_cond_signal(&idleCond);
+		pthread_mutex_unlock(&idleLock);
+	}
+	else
+	{
+		run(args);
+		task->done=1;
+	}
+
+
+	return;
+}
+
+/*
+ * Waits for a spawned task. Rather than block, the caller keeps running
+ * tasks: its own newest first (usually the very task it waits for), then
+ * ones stolen from other workers.
+ */
+void join(Task *task)
+{
+	while(!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+	{
+		Task *other=findTask();
+
+		if(other!=NULL)
+		{
+			other->run(other->args);
+			__atomic_store_n(&other->done, 1, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			sched_yield();
+		}
+	}
+
+
+	return;
+}
+
+/*
+ * Pops the newest task off the calling worker's deque or, failing that,
+ * steals the oldest task of another worker, trying them all once starting at
+ * a random one. NULL if every deque is empty.
+ */
+Task* findTask()
+{
+	Worker *me=&workers[self];
+	Task *task=NULL;
+	int i, victim;
+
+
+	pthread_mutex_lock(&me->lock);
+	if(me->bottom!=me->top)
+	{
+		me->bottom--;
+		task=me->deque[me->bottom%DEQUE_SIZE];
+	}
+	pthread_mutex_unlock(&me->lock);
+
+	victim=rand_r(&me->seed)%threads;
+	for(i=0; i<threads && task==NULL; i++, victim=(victim+1)%threads)
+	{
+		Worker *other=&workers[victim];
+
+		if(other!=me && other->bottom!=other->top)
+		{
+			pthread_mutex_lock(&other->lock);
+			if(other->bottom!=other->top)
+			{
+				task=other->deque[other->top%DEQUE_SIZE];
+				other->top++;
+			}
+			pthread_mutex_unlock(&other->lock);
+		}
+	}
+
+	if(task!=NULL)
+		__atomic_sub_fetch(&queued, 1, __ATOMIC_RELAXED);
+
+
+	return task;
+}
 
+//the radix sort engine for -r
+RADIX_SORT(radixSort32, int, INT32_KEY)